@@ -0,0 +1,288 @@
+#include "engine.c"
+
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/**
+  Benchmarks for the engine. Build with optimizations, e.g.
+
+    gcc -O2 -o bench bench.c -lm -pthread
+    ./bench          # human-readable tables
+    ./bench --json   # per-phase suite as JSON, for tracking regressions
+ */
+
+/** ********** UTILS ********** **/
+
+// monotonic clock in nanoseconds
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// peak resident set size of the process so far, in KiB
+static long peak_rss_kb(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+/** ********** GRAPHS ********** **/
+
+// x_n = (...((x + x) + x) ...) + x; depth grows with n
+static Value *chain_graph(int n) {
+  Value *x = defaultValue(1);
+  Value *c = x;
+  for (int i = 1; i < n; i++)
+    c = add(c, x);
+  return c;
+}
+
+// balanced tree of adds over n leaves; depth is log2(n)
+static Value *wide_graph(Value **level, int n) {
+  for (int i = 0; i < n; i++)
+    level[i] = defaultValue(1);
+  while (n > 1) {
+    int half = 0;
+    for (int i = 0; i + 1 < n; i += 2)
+      level[half++] = add(level[i], level[i + 1]);
+    if (n % 2)
+      level[half++] = level[n - 1];
+    n = half;
+  }
+  return level[0];
+}
+
+// v_i = v_(i-1) * v_(i-2) + v_(i-1): every node feeds several parents
+static Value *shared_graph(int n) {
+  Value *prev = defaultValue(1), *cur = defaultValue(1);
+  for (int i = 2; i < n; i += 2) {
+    Value *next = add(mul(cur, prev), cur);
+    prev = cur;
+    cur = next;
+  }
+  return cur;
+}
+
+// squared output of a width x width x 1 MLP on fresh inputs
+static Value *mlp_graph(MLP *m, Value **x, int width) {
+  Value *out;
+  for (int i = 0; i < width; i++)
+    x[i] = defaultValue(0.5f);
+  mlp_forward(m, x, &out);
+  return mul(out, out);
+}
+
+/** ********** TOPOLOGICAL SORT ********** **/
+
+/**
+ * @brief Reports ns/node of build_dag on chain- and wide-shaped graphs
+ *
+ * A linear sort shows a flat ns/node column as the graph size grows.
+ */
+static void bench_build_dag(void) {
+  const int max_nodes = 1 << 20;
+  const int reps = 5;
+  Topo topo;
+  topo_init(&topo);
+  Value **level = (Value **)malloc(max_nodes * sizeof(Value *));
+  Arena *arena = arena_create(0);
+  set_arena(arena);
+
+  printf("%-6s %10s %12s\n", "shape", "nodes", "ns/node");
+  for (int shape = 0; shape < 2; shape++) {
+    for (int n = 1 << 10; n <= max_nodes; n <<= 1) {
+      Value *root = shape == 0 ? chain_graph(n) : wide_graph(level, n);
+
+      int dag_size = 0;
+      double start = now_ns();
+      for (int r = 0; r < reps; r++)
+        dag_size = build_dag(root, &topo);
+      double elapsed = now_ns() - start;
+
+      printf("%-6s %10d %12.2f\n", shape == 0 ? "chain" : "wide", dag_size,
+             elapsed / reps / dag_size);
+      arena_reset(arena);
+    }
+  }
+
+  set_arena(NULL);
+  arena_destroy(arena);
+  free(level);
+  topo_free(&topo);
+}
+
+/** ********** TAPE ********** **/
+
+/**
+ * @brief Compares reverse (DFS sort + pointer walk) with tape_reverse
+ *
+ * Both get the same graph; the tape version records it while it is built
+ * and walks the records backward, including copying gradients back into
+ * the Values.
+ */
+static void bench_tape(void) {
+  const int max_nodes = 1 << 18;
+  const int reps = 5;
+  Value **level = (Value **)malloc(max_nodes * sizeof(Value *));
+  SoAGraph *tape = tape_create();
+  Arena *arena = arena_create(0);
+  set_arena(arena);
+
+  printf("\n%-6s %10s %14s %14s\n", "shape", "nodes", "reverse ns/n",
+         "tape ns/n");
+  for (int shape = 0; shape < 2; shape++) {
+    for (int n = 1 << 12; n <= max_nodes; n <<= 2) {
+      tape_clear(tape);
+      tape_begin(tape);
+      Value *root = shape == 0 ? chain_graph(n) : wide_graph(level, n);
+      tape_end();
+
+      double start = now_ns();
+      for (int r = 0; r < reps; r++)
+        reverse(root);
+      double t_reverse = (now_ns() - start) / reps;
+
+      start = now_ns();
+      for (int r = 0; r < reps; r++)
+        tape_reverse(tape, root);
+      double t_tape = (now_ns() - start) / reps;
+
+      printf("%-6s %10d %14.2f %14.2f\n", shape == 0 ? "chain" : "wide",
+             tape->n, t_reverse / tape->n, t_tape / tape->n);
+      arena_reset(arena);
+    }
+  }
+
+  set_arena(NULL);
+  arena_destroy(arena);
+  soa_free(tape);
+  free(level);
+}
+
+/**
+ * @brief Times tensor_matmul forward and backward on square matrices
+ *
+ * Operands and products are malloc'd and released with tensor_free after
+ * every size, so the loop does not grow the heap.
+ */
+static void bench_matmul(void) {
+  const int reps = 5;
+
+  printf("\n%-6s %14s %14s\n", "n", "forward GF/s", "backward GF/s");
+  for (int n = 64; n <= 512; n <<= 1) {
+    int shape[2] = {n, n};
+    Tensor *a = defaultTensor(NULL, 2, shape);
+    Tensor *b = defaultTensor(NULL, 2, shape);
+    for (int i = 0; i < n * n; i++) {
+      a->data[i] = elem_store((float)(i % 7) / 7);
+      b->data[i] = elem_store((float)(i % 5) / 5);
+    }
+
+    double t_forward = 0, t_backward = 0;
+    for (int r = 0; r < reps; r++) {
+      double start = now_ns();
+      Tensor *c = tensor_matmul(a, b);
+      t_forward += now_ns() - start;
+
+      start = now_ns();
+      tensor_reverse(c);
+      t_backward += now_ns() - start;
+      tensor_free(c);
+    }
+
+    double flops = 2.0 * n * n * n * reps;
+    printf("%-6d %14.2f %14.2f\n", n, flops / t_forward,
+           2 * flops / t_backward);
+    tensor_free(a);
+    tensor_free(b);
+  }
+}
+
+/** ********** SUITE ********** **/
+
+enum { SHAPE_CHAIN, SHAPE_TREE, SHAPE_MLP, SHAPE_SHARED, N_SHAPES };
+static const char *shape_names[N_SHAPES] = {"chain", "tree", "mlp", "shared"};
+
+/**
+ * @brief Times construction, build_dag and the backward loop per shape/size
+ *
+ * Every phase is timed separately and the best of `reps` runs is kept,
+ * which is far less noisy than the mean. The backward loop is the one
+ * inside reverse, run over an already sorted order. Graphs come from an
+ * arena so teardown is not part of any phase. peak_rss_kb is the process
+ * high-water mark after the case, so it only grows along the output.
+ * Output is one JSON object with a fixed key order.
+ */
+static void bench_suite(void) {
+  const int max_nodes = 1 << 18;
+  const int reps = 7;
+  Topo topo;
+  topo_init(&topo);
+  Value **level = (Value **)malloc(max_nodes * sizeof(Value *));
+  Arena *arena = arena_create(0);
+
+  printf("{\n  \"unit\": \"ns/node\",\n  \"results\": [");
+  int first = 1;
+  for (int shape = 0; shape < N_SHAPES; shape++) {
+    for (int n = 1 << 10; n <= max_nodes; n <<= 2) {
+      int width = (int)sqrt(n / 2.0);
+      MLP *m = NULL;
+      if (shape == SHAPE_MLP) {
+        int sizes[2] = {width, 1};
+        m = mlp_create(width, sizes, 2, 1);
+      }
+
+      double best[3] = {1e300, 1e300, 1e300};
+      int nodes = 0;
+      for (int r = 0; r < reps; r++) {
+        set_arena(arena);
+        double t0 = now_ns();
+        Value *root = shape == SHAPE_CHAIN  ? chain_graph(n)
+                      : shape == SHAPE_TREE ? wide_graph(level, n)
+                      : shape == SHAPE_MLP  ? mlp_graph(m, level, width)
+                                            : shared_graph(n);
+        double t1 = now_ns();
+        nodes = build_dag(root, &topo);
+        double t2 = now_ns();
+        root->grad = 1.0;
+        for (int i = topo.size - 1; i >= 0; i--)
+          if (topo.order[i]->reverse)
+            topo.order[i]->reverse(topo.order[i]);
+        double t3 = now_ns();
+        set_arena(NULL);
+
+        double t[3] = {t1 - t0, t2 - t1, t3 - t2};
+        for (int k = 0; k < 3; k++)
+          best[k] = t[k] < best[k] ? t[k] : best[k];
+        arena_reset(arena);
+      }
+      mlp_free(m);
+
+      printf("%s\n    {\"shape\": \"%s\", \"nodes\": %d, "
+             "\"construct\": %.3f, \"build_dag\": %.3f, "
+             "\"backward\": %.3f, \"peak_rss_kb\": %ld}",
+             first ? "" : ",", shape_names[shape], nodes, best[0] / nodes,
+             best[1] / nodes, best[2] / nodes, peak_rss_kb());
+      first = 0;
+    }
+  }
+  printf("\n  ]\n}\n");
+
+  arena_destroy(arena);
+  free(level);
+  topo_free(&topo);
+}
+
+/** ********** MAIN ********** **/
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--json") == 0) {
+    bench_suite();
+    return 0;
+  }
+  bench_build_dag();
+  bench_tape();
+  bench_matmul();
+  return 0;
+}
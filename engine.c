@@ -1,347 +1,5955 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// initial capacity of a topological order buffer (grows geometrically)
+#define TOPO_INIT_CAP 256
+// max number of dimensions of a Tensor
+#define TENSOR_MAX_DIMS 4
+// alignment of Tensor data and grad buffers in bytes
+#define TENSOR_ALIGN 64
+// alignment of every section of a saved SoAGraph file
+#define SOA_FILE_ALIGN 64
+// levels with fewer nodes than this run on the calling thread only
+#define PARALLEL_MIN_LEVEL 256
+// nodes a worker claims at a time during a parallel backward pass
+#define PARALLEL_CHUNK 32
+// matmul cache blocking: rows of A, depth, and columns of B per block
+#define GEMM_MC 64
+#define GEMM_KC 256
+#define GEMM_NC 1024
+// optimization flags for the C code generated by jit_compile
+#define JIT_CFLAGS "-O2"
+// nodes per function of generated code
+#define JIT_CHUNK 256
+// gradients per slot of a shared-memory all-reduce (larger buffers go in
+// pieces)
+#define COMM_SHM_CAP (64 * 1024)
+// connect attempts, 10 ms apart, before comm_tcp gives up on a peer
+#define COMM_CONNECT_TRIES 1000
+// parameters per all-reduce bucket of dp_backward
+#define DP_BUCKET 4096
+// default size of an arena chunk in bytes
+#define ARENA_CHUNK_SIZE (64 * 1024)
+// node pool size classes: nodes with 0 .. NODE_POOL_CLASSES - 1 children
+#define NODE_POOL_CLASSES 3
+// max free nodes a thread keeps per size class
+#define NODE_POOL_MAX 4096
+
+// build with -DMICROGRAD_BLAS (and -lcblas / -lopenblas) to run matmul on BLAS
+#ifdef MICROGRAD_BLAS
+#include <cblas.h>
+#endif
+
+/**
+   Element types, selected at compile time:
+   - default: fp32 values and gradients
+   - -DMICROGRAD_DOUBLE: fp64 values and gradients
+   - -DMICROGRAD_GRAD_DOUBLE: fp32 values, fp64 gradient accumulation
+   - -DMICROGRAD_TENSOR_BF16 / -DMICROGRAD_TENSOR_FP16: Tensor data stored in
+     16 bits to halve memory traffic; kernels widen to fp32 to compute and
+     Tensor gradients stay fp32
+   The math macros pick the libm variant that matches scalar_t (SQRT matches
+   grad_t), so no kernel silently round-trips through double.
+   -DMICROGRAD_FAST_MATH swaps EXP, LOG and TANH in fp32 builds for the
+   branch-free polynomial approximations below (at most about 2.5e-7
+   relative error over the finite range, including tanh near 0), which also
+   lets the compiler vectorize batched SoA loops over them.
+*/
+#ifdef MICROGRAD_DOUBLE
+typedef double scalar_t;
+typedef double grad_t;
+#define POW pow
+#define LOG log
+#define EXP exp
+#define TANH tanh
+#define SQRT sqrt
+#else
+typedef float scalar_t;
+#define POW powf
+#if defined(MICROGRAD_FAST_MATH)
+#define LOG fast_logf
+#define EXP fast_expf
+#define TANH fast_tanhf
+#else
+#define LOG logf
+#define EXP expf
+#define TANH tanhf
+#endif
+#ifdef MICROGRAD_GRAD_DOUBLE
+typedef double grad_t;
+#define SQRT sqrt
+#else
+typedef float grad_t;
+#define SQRT sqrtf
+#endif
+#endif
+
+#if defined(MICROGRAD_TENSOR_BF16)
+typedef uint16_t tensor_t;
+#elif defined(MICROGRAD_TENSOR_FP16)
+typedef _Float16 tensor_t;
+#else
+typedef float tensor_t;
+#define MICROGRAD_TENSOR_FP32
+#endif
+
+#if defined(MICROGRAD_BLAS) &&                                                 \
+    (defined(MICROGRAD_TENSOR_BF16) || defined(MICROGRAD_TENSOR_FP16))
+#error "MICROGRAD_BLAS needs fp32 Tensor storage"
+#endif
+
+// widen a stored Tensor element to fp32
+static inline float elem_load(tensor_t x) {
+#if defined(MICROGRAD_TENSOR_BF16)
+  union {
+    uint32_t u;
+    float f;
+  } v = {(uint32_t)x << 16};
+  return v.f;
+#else
+  return (float)x;
+#endif
+}
+
+// narrow an fp32 value to Tensor storage (bf16 rounds to nearest even)
+static inline tensor_t elem_store(float x) {
+#if defined(MICROGRAD_TENSOR_BF16)
+  union {
+    float f;
+    uint32_t u;
+  } v = {x};
+  return (tensor_t)((v.u + 0x7fff + ((v.u >> 16) & 1)) >> 16);
+#else
+  return (tensor_t)x;
+#endif
+}
+
+// bit casts between a float and its IEEE-754 encoding
+static inline uint32_t float_bits(float x) {
+  union {
+    float f;
+    uint32_t u;
+  } v = {x};
+  return v.u;
+}
+
+static inline float bits_float(uint32_t x) {
+  union {
+    uint32_t u;
+    float f;
+  } v = {x};
+  return v.f;
+}
 
-// limit the magnitude of the gradients (used in gradient clip)
-#define MIN_RANGE -10.0
-#define MAX_RANGE 10
-// max DAG size
-#define MAX_DAG_SIZE 1000
+/**
+ * @brief exp(x) as 2^k * p(r) with k = round(x / ln 2) and |r| <= ln 2 / 2
+ *
+ * p is the degree-6 Taylor polynomial, and ln 2 is split in two so r keeps
+ * its low bits. Inputs above 88 are clamped to the finite fp32 range, and
+ * below -87 the result flushes to 0 instead of going through denormals.
+ */
+static inline float fast_expf(float x) {
+  float lo = x;
+  x = x < -87.0f ? -87.0f : x > 88.0f ? 88.0f : x;
+  float t = x * 1.44269504f;
+  int k = (int)(t + (t < 0 ? -0.5f : 0.5f));
+  float r = x - k * 0.693145751953125f - k * 1.428606765330187e-6f;
+  float p =
+      1 + r * (1 + r * (0.5f + r * (1.0f / 6 +
+                                    r * (1.0f / 24 +
+                                         r * (1.0f / 120 + r / 720)))));
+  float y = p * bits_float((uint32_t)(k + 127) << 23);
+  return lo < -87.0f ? 0 : y;
+}
+
+/**
+ * @brief log(x) as e ln 2 + log(m) with x = m 2^e and m in [sqrt(1/2),
+ * sqrt(2)), using log(m) = 2 atanh((m - 1) / (m + 1)) to the f^9 term
+ */
+static inline float fast_logf(float x) {
+  if (!(x > 0))
+    return x == 0 ? -HUGE_VALF : NAN;
+  uint32_t u = float_bits(x);
+  int e = (int)(u >> 23) - 127;
+  float m = bits_float((u & 0x7fffff) | 0x3f800000);
+  if (m > 1.41421356f) {
+    m *= 0.5f;
+    e++;
+  }
+  float f = (m - 1) / (m + 1), f2 = f * f;
+  float s = f * (2 + f2 * (2.0f / 3 +
+                           f2 * (2.0f / 5 + f2 * (2.0f / 7 + f2 * 2.0f / 9))));
+  return e * 0.693147181f + s;
+}
+
+/**
+ * @brief tanh(x) = 1 - 2 / (exp(2|x|) + 1) with the sign of x, except below
+ * |x| = 0.55, where that form cancels and the odd Taylor polynomial to x^15
+ * is used instead
+ */
+static inline float fast_tanhf(float x) {
+  float a = x < 0 ? -x : x, a2 = a * a;
+  float p = 929569.0f / 638512875;
+  p = a2 * p - 21844.0f / 6081075;
+  p = a2 * p + 1382.0f / 155925;
+  p = a2 * p - 62.0f / 2835;
+  p = a2 * p + 17.0f / 315;
+  p = a2 * p - 2.0f / 15;
+  p = a2 * p + 1.0f / 3;
+  float small = a - a * a2 * p;
+  float large = 1 - 2 / (fast_expf(2 * a) + 1);
+  float r = a < 0.55f ? small : large;
+  return x < 0 ? -r : r;
+}
+
+/**
+  @enum  Op
+  @brief operation that produced a node; lets index-based graph forms dispatch
+  with a switch. OP_CUSTOM nodes are only reachable through their function
+  pointers.
+ */
+typedef enum Op {
+  OP_LEAF,
+  OP_ADD,
+  OP_MUL,
+  OP_PWR,
+  OP_RELU,
+  OP_NEG,
+  OP_SUB,
+  OP_DIV,
+  OP_MUL_ADD,
+  OP_LINEAR_RELU,
+  OP_LINEAR,
+  OP_SUM,
+  OP_MEAN,
+  OP_DOT,
+  OP_EXP,
+  OP_LOG,
+  OP_TANH,
+  OP_SIGMOID,
+  OP_SOFTMAX_CE,
+  OP_CUSTOM,
+  OP_COUNT // number of op codes
+} Op;
 
 /**
   @struct Value
   @brief  Node in a computational graph w/ scalar and its gradient
-  @param (data: float) scalar
-  @param (grad: float) gradient; computed during backward pass
+  @param (data: scalar_t) scalar
+  @param (grad: grad_t) gradient; computed during backward pass
+  @param (tangent: scalar_t) directional derivative; propagated during
+  construction in forward mode
   @param (children: [Value]) DAG of children
   @param (n_children: int) number of children
   @param (reverse : void) function pointer to backwards function; responsible
   for computing the gradient
+  @param (forward : void) function pointer that recomputes data from the
+  children; used to replay a compiled graph
+  @param (visit: unsigned int) epoch of the last topological sort that reached
+  this node; lets build_dag mark nodes as visited in O(1)
+  @param (op: Op) operation that produced the node
+  @param (index: int) position of the node in the last index-based pass over
+  it (SoAGraph, reverse_parallel)
+  @param (refs: int) parents holding the node plus value_retain calls; a
+  node is released once nothing references it
+  @param (flags: unsigned int) VALUE_* bits
   @returns Value object with the fields
  */
 typedef struct Value {
-  float data;
-  float grad;
+  scalar_t data;
+  grad_t grad;
+  scalar_t tangent;
 
   struct Value **children;
   int n_children;
   void (*reverse)(struct Value *);
+  void (*forward)(struct Value *);
 
+  unsigned int visit;
+  Op op;
+  int index;
+
+  int refs;
+  unsigned int flags;
 } Value;
 
+// node lives in an Arena and is released by arena_reset, never by free
+#define VALUE_ARENA 0x1
+// node is a plain node-pool block that can be recycled instead of freed
+#define VALUE_POOLED 0x2
+// node lives in storage owned elsewhere (e.g. a Layer's parameter block)
+#define VALUE_OWNED 0x4
+// leaf is a constant (constValue or folded): optimize_graph may fold through
+// it and merge it with equal constants
+#define VALUE_CONST 0x8
+// gradient of the node is wanted: set on defaultValue leaves and on every
+// op node with such a child; reverse prunes everything else
+#define VALUE_REQUIRES_GRAD 0x10
+
+/** ********** STATS ********** **/
+
 /**
-  @brief initialize Value object by floating point number
-  @param (x) float to be converted into a Value object
-  @returns Value object
+   Build with -DMICROGRAD_STATS to count nodes and node bytes per op at
+   construction and to time every reverse function by op during reverse,
+   graph_backward and reverse_parallel. Checkpoint replays are counted too:
+   a segment's nodes are counted each time it is rebuilt (in the forward and
+   again in the backward pass) and its reverse functions are timed on their
+   own as well as inside the checkpoint's. Counters are process-wide relaxed
+   atomics. Without the flag the hooks below expand to nothing (or to the
+   plain reverse call) and the stats API does not exist.
+*/
+#ifdef MICROGRAD_STATS
+
+/**
+  @struct Stats
+  @brief  Snapshot of the instrumentation counters, indexed by Op
+  @param (nodes: [unsigned long long]) nodes created
+  @param (bytes: [unsigned long long]) bytes requested for those nodes,
+  including recycled ones
+  @param (reverse_calls: [unsigned long long]) reverse functions run
+  @param (reverse_ns: [unsigned long long]) time spent in them; a
+  checkpoint's time includes its replayed segment
  */
-Value *defaultValue(float x) {
-  Value *v = (Value *)malloc(sizeof(Value));
+typedef struct Stats {
+  unsigned long long nodes[OP_COUNT];
+  unsigned long long bytes[OP_COUNT];
+  unsigned long long reverse_calls[OP_COUNT];
+  unsigned long long reverse_ns[OP_COUNT];
+} Stats;
 
-  v->data = x;
-  v->grad = 0;
-  v->children = NULL;
-  v->n_children = 0;
-  v->reverse = NULL;
+static Stats stats;
 
-  return v;
+static inline void stats_node(Op op, size_t bytes) {
+  __atomic_fetch_add(&stats.nodes[op], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats.bytes[op], bytes, __ATOMIC_RELAXED);
 }
 
-/** ********** UTILS ********** **/
+static inline void stats_reverse(Value *v) {
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  v->reverse(v);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  unsigned long long ns =
+      (t1.tv_sec - t0.tv_sec) * 1000000000ull + (t1.tv_nsec - t0.tv_nsec);
+  __atomic_fetch_add(&stats.reverse_calls[v->op], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats.reverse_ns[v->op], ns, __ATOMIC_RELAXED);
+}
+
+#define STATS_NODE(op, bytes) stats_node(op, bytes)
+#define REVERSE_NODE(v) stats_reverse(v)
 
 /**
-  @brief print value and gradient
-  @param (obj: Value) Value object
+  @brief copy the current counters
+  @param (out: Stats) receives the snapshot
  */
-void print(Value *obj) {
-  printf("Value: %f, Gradient: %f \n", obj->data, obj->grad);
+void stats_snapshot(Stats *out) {
+  unsigned long long *src = (unsigned long long *)&stats;
+  unsigned long long *dst = (unsigned long long *)out;
+  for (size_t i = 0; i < sizeof(Stats) / sizeof(*src); i++)
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
 }
 
 /**
- @brief clips the gradient if it exceeds a certain range
- @param (obj: Value) Value object
-*/
-void grad_clip(Value *obj) {
-  if (obj->grad < MIN_RANGE) {
-    obj->grad = MIN_RANGE;
-  } else if (obj->grad > MAX_RANGE) {
-    obj->grad = MAX_RANGE;
-  }
+  @brief zero every counter
+ */
+void stats_reset(void) {
+  unsigned long long *c = (unsigned long long *)&stats;
+  for (size_t i = 0; i < sizeof(Stats) / sizeof(*c); i++)
+    __atomic_store_n(&c[i], 0, __ATOMIC_RELAXED);
 }
 
 /**
- * @brief Frees memory allocated for a Value node and its children
- *
- * This function recursively frees the memory allocated for a Value node
- * and all of its children. It first iterates through the children array,
- * freeing each child node, and then frees the memory allocated for the
- * current node itself.
- *
- * @param val Pointer to the Value node to be freed
+  @brief short lowercase name of an op, for labelling scraped counters
+  @param (op: Op) op code
+  @returns static string
  */
-void free_node(Value *val) {
-  for (int i = 0; i < val->n_children; i++) {
-    if (val->children[i]) {
-      free(val->children[i]);
-      val->n_children -= 1;
-    }
-  }
-  free(val);
+const char *op_name(Op op) {
+  static const char *names[OP_COUNT] = {
+      "leaf", "add",         "mul",    "pwr", "relu", "neg",  "sub", "div",
+      "mul_add", "linear_relu", "linear", "sum", "mean", "dot", "exp", "log",
+      "tanh", "sigmoid", "softmax_ce", "custom"};
+  return op >= 0 && op < OP_COUNT ? names[op] : "?";
 }
+#else
+#define STATS_NODE(op, bytes) ((void)0)
+#define REVERSE_NODE(v) (v)->reverse(v)
+#endif
 
-/** ********** BACKPASS LOGIC ********** **/
+/** ********** ARENA ********** **/
 
 /**
- * @brief Builds a Directed Acyclic Graph (DAG) and topologically sorts it
- *
- * This function constructs a DAG from the given Value object and its children,
- * then performs a topological sort on the graph. It's a crucial helper for the
- * reverse pass in backpropagation, ensuring that gradients are computed in the
- * correct order.
- *
- * @param val Pointer to the root Value object
- * @param dag Array to store the topologically sorted Value objects
- * @param dag_size Pointer to the size of the DAG
- * @param visited Array to keep track of visited Value objects
- * @param len_visited Pointer to the number of visited Value objects
- */
-void build_dag(Value *val, Value **dag, int *dag_size, Value **visited,
-               int *len_visited) {
-  for (int i = 0; i < *dag_size; i++)
-    if (visited[i] == val)
-      return;
+  @struct ArenaChunk
+  @brief  One block of memory owned by an Arena
+  @param (next: ArenaChunk) next block in allocation order
+  @param (size: size_t) usable bytes in mem
+  @param (used: size_t) bytes handed out so far
+  @param (mem: max_align_t[]) the storage itself
+ */
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+  size_t used;
+  max_align_t mem[];
+} ArenaChunk;
 
-  visited[*len_visited] = val;
-  *len_visited += 1;
+/**
+  @struct Arena
+  @brief  Bump allocator for a whole graph; nodes are never freed one by one
+  @param (head: ArenaChunk) first chunk
+  @param (cur: ArenaChunk) chunk currently being carved up
+  @param (chunk_size: size_t) size of newly allocated chunks
+ */
+typedef struct Arena {
+  ArenaChunk *head;
+  ArenaChunk *cur;
+  size_t chunk_size;
+} Arena;
 
-  for (int i = 0; i < val->n_children; i++)
-    build_dag(val->children[i], dag, dag_size, visited, len_visited);
+// arena that defaultValue and the operators draw from on this thread; NULL
+// means malloc
+static _Thread_local Arena *active_arena = NULL;
+
+// allocate a chunk with `size` usable bytes
+static ArenaChunk *arena_chunk(size_t size) {
+  ArenaChunk *chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + size);
+  if (!chunk)
+    return NULL;
 
-  dag[*dag_size] = val;
-  *dag_size += 1;
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
 }
 
 /**
- * @brief Performs the reverse pass (backpropagation) on a computational graph
+  @brief create an arena
+  @param (chunk_size: size_t) bytes per chunk; 0 selects ARENA_CHUNK_SIZE
+  @returns Arena object, or NULL if out of memory
+ */
+Arena *arena_create(size_t chunk_size) {
+  Arena *arena = (Arena *)malloc(sizeof(Arena));
+  if (!arena)
+    return NULL;
+
+  arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+  arena->head = arena_chunk(arena->chunk_size);
+  if (!arena->head) {
+    free(arena);
+    return NULL;
+  }
+  arena->cur = arena->head;
+  return arena;
+}
+
+/**
+ * @brief Hands out `size` bytes from the arena
  *
- * This function executes the backward pass of automatic differentiation.
- * It builds a topologically sorted DAG, initializes the gradient of the root
- * node to 1.0, and then propagates the gradients backward through the graph,
- * calling each node's reverse function to compute partial derivatives.
+ * Allocation is a pointer bump inside the current chunk. When the chunk is
+ * full the arena moves on to the next chunk kept from a previous cycle, or
+ * links a new one after the current chunk. Requests larger than the chunk
+ * size get a dedicated chunk.
  *
- * @param root Pointer to the root Value object of the computational graph
+ * @param arena Pointer to the Arena
+ * @param size Number of bytes requested
+ * @return Pointer aligned for any type, or NULL if out of memory
  */
-void reverse(Value *root) {
-  Value *dag[MAX_DAG_SIZE];
-  int dag_size = 0;
+void *arena_alloc(Arena *arena, size_t size) {
+  const size_t align = sizeof(max_align_t);
+  size = (size + align - 1) & ~(align - 1);
 
-  Value *visited[MAX_DAG_SIZE];
-  int len_visited = 0;
+  ArenaChunk *cur = arena->cur;
+  if (cur->size - cur->used < size) {
+    ArenaChunk *next = cur->next;
+    if (next && next->size >= size) {
+      next->used = 0;
+    } else {
+      size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+      next = arena_chunk(chunk_size);
+      if (!next)
+        return NULL;
+      next->next = cur->next;
+      cur->next = next;
+    }
+    arena->cur = cur = next;
+  }
 
-  build_dag(root, dag, &dag_size, visited, &len_visited);
-  root->grad = 1.0;
+  void *ptr = (unsigned char *)cur->mem + cur->used;
+  cur->used += size;
+  return ptr;
+}
 
-  for (int i = dag_size - 1; i >= 0; i--) {
-    if (dag[i]->reverse)
-      dag[i]->reverse(dag[i]);
+// 1 if p lies in memory handed out by the arena since its last reset
+static int arena_owns(const Arena *arena, const void *p) {
+  const unsigned char *q = (const unsigned char *)p;
+  for (const ArenaChunk *c = arena->head; c; c = c->next) {
+    const unsigned char *mem = (const unsigned char *)c->mem;
+    if (q >= mem && q < mem + c->used)
+      return 1;
+    if (c == arena->cur)
+      break;
   }
+  return 0;
 }
 
 /**
-   Reverse pass functions for each operation (+, -, *, **, relu)
-*/
+  @brief release everything allocated from the arena in O(1); chunks are kept
+  and reused by the next graph
+  @param (arena: Arena) Arena object
+ */
+void arena_reset(Arena *arena) {
+  arena->cur = arena->head;
+  arena->head->used = 0;
+}
 
 /**
- @brief computes gradient after completing add operation (backprop)
- @param (c : Value) Value object
+  @brief free the arena and all of its chunks
+  @param (arena: Arena) Arena object
  */
-void add_reverse(Value *c) {
-  c->children[0]->grad += c->grad;
-  c->children[1]->grad += c->grad;
+void arena_destroy(Arena *arena) {
+  if (!arena)
+    return;
 
-  grad_clip(c->children[0]);
-  grad_clip(c->children[1]);
+  ArenaChunk *chunk = arena->head;
+  while (chunk) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  if (active_arena == arena)
+    active_arena = NULL;
+  free(arena);
 }
 
 /**
- @brief computes gradient after completing multiplication operation (backprop)
- @param (c : Value) Value object
-
- - Note after backpropagating, dc/da = grad of c * b
- - Similarly, dc/db = grad of c * a
+  @brief make every following defaultValue / operator call on this thread
+  allocate from `arena`; pass NULL to go back to malloc
+  @param (arena: Arena) Arena object or NULL
+  @returns the previously active arena
  */
-void mul_reverse(Value *c) {
-  c->children[0]->grad += c->grad * c->children[1]->data;
-  c->children[1]->grad += c->grad * c->children[0]->data;
-
-  grad_clip(c->children[0]);
-  grad_clip(c->children[1]);
+Arena *set_arena(Arena *arena) {
+  Arena *prev = active_arena;
+  active_arena = arena;
+  return prev;
 }
 
+/** ********** NODE POOL ********** **/
+
 /**
- @brief computes gradient after completing power operation (backprop)
- @param (c : Value) Value object
+  @struct NodePool
+  @brief  Per-thread free lists of recycled nodes, one per children count
+  @param (enabled: int) whether this thread recycles nodes
+  @param (head: [Value]) first free node of each size class; free nodes are
+  linked through their first word
+  @param (count: [int]) free nodes held per size class
+ */
+typedef struct NodePool {
+  int enabled;
+  Value *head[NODE_POOL_CLASSES];
+  int count[NODE_POOL_CLASSES];
+} NodePool;
 
- - dc/da = b * a^(b-1)
- - dc/db = log(a) * a^b
+static _Thread_local NodePool node_pool;
 
- After backpropagating, the final gradient:
- - dc/da = b * a^(b-1) * grad of c
- - dc/db = c * log(a) * grad of c
+/**
+  @brief return every node cached by the calling thread to malloc
  */
-void pwr_reverse(Value *c) {
-  Value *a = c->children[0];
-  Value *b = c->children[1];
+void node_pool_trim(void) {
+  for (int k = 0; k < NODE_POOL_CLASSES; k++) {
+    Value *v = node_pool.head[k];
+    while (v) {
+      Value *next = *(Value **)v;
+      free(v);
+      v = next;
+    }
+    node_pool.head[k] = NULL;
+    node_pool.count[k] = 0;
+  }
+}
+
+/**
+  @brief turn node recycling on or off for the calling thread; turning it off
+  releases the nodes the thread has cached
+  @param (enabled: int) 1 to recycle freed nodes, 0 to return them to malloc
+ */
+void node_pool_enable(int enabled) {
+  node_pool.enabled = enabled;
+  if (!enabled)
+    node_pool_trim();
+}
 
-  a->grad += b->data * pow(a->data, b->data - 1) * c->grad;
+// pop a node with k children slots, or NULL if the free list is empty
+static Value *node_pool_pop(int k) {
+  Value *v = node_pool.head[k];
+  if (v) {
+    node_pool.head[k] = *(Value **)v;
+    node_pool.count[k]--;
+  }
+  return v;
+}
 
-  // note: check needed bc log(0) = infinity
-  if (b->data > 0)
-    b->grad += log(a->data) * c->data + c->grad;
+// push a node back on its free list; 0 if the list is full
+static int node_pool_push(Value *v) {
+  int k = v->n_children;
+  if (!node_pool.enabled || node_pool.count[k] >= NODE_POOL_MAX)
+    return 0;
 
-  grad_clip(c->children[0]);
-  grad_clip(c->children[1]);
+  *(Value **)v = node_pool.head[k];
+  node_pool.head[k] = v;
+  node_pool.count[k]++;
+  return 1;
 }
 
+// set by no_grad_enable; operators then return childless results
+static _Thread_local int no_grad = 0;
+// children slots lent to no-grad nodes until finish_node drops them
+static _Thread_local Value **no_grad_slots = NULL;
+static _Thread_local int no_grad_cap = 0;
+static int grow_buffer(void **buf, int *cap, int need, size_t elem);
+
 /**
- * @brief Computes gradient for ReLU function during backpropagation
+ * @brief Allocates a node with room for its children array
  *
- * This function calculates the gradient for the Rectified Linear Unit (ReLU)
- * activation during the backward pass of backpropagation. ReLU's gradient is 1
- * for positive inputs and 0 for negative or zero inputs. This preserves the
- * gradient for active (positive) neurons while blocking it for inactive ones.
+ * The children pointers are stored inline right after the node, so every
+ * node costs a single allocation from the active arena (or malloc). Nodes
+ * that carry extra state embed a Value as their first member and pass the
+ * size of the enclosing struct. In no-grad mode plain nodes borrow a
+ * thread-local slot buffer instead, since finish_node drops the children
+ * right after the forward, so they are allocated and pooled as leaves.
  *
- * @param c Pointer to the Value object representing the ReLU operation
+ * @param size Bytes of the node struct, at least sizeof(Value)
+ * @param op Operation that produces the node
+ * @param n_children Number of children slots
+ * @return Pointer to a zeroed Value whose `children` points at its slots
  */
-void relu_reverse(Value *c) {
-  Value *a = c->children[0];
-  a->grad += (a->data > 0) ? c->grad : 0;
-  grad_clip(a);
+static Value *make_node_sized(size_t size, Op op, int n_children) {
+  size = (size + sizeof(Value *) - 1) & ~(sizeof(Value *) - 1);
+  int borrow = no_grad && size == sizeof(Value) &&
+               grow_buffer((void **)&no_grad_slots, &no_grad_cap, n_children,
+                           sizeof(Value *)) == 0;
+  int n_slots = borrow ? 0 : n_children;
+  size_t bytes = size + n_slots * sizeof(Value *);
+  int pooled = !active_arena && size == sizeof(Value) &&
+               n_slots < NODE_POOL_CLASSES;
+
+  Value *v = NULL;
+  if (pooled && node_pool.enabled)
+    v = node_pool_pop(n_slots);
+  if (!v)
+    v = active_arena ? (Value *)arena_alloc(active_arena, bytes)
+                     : (Value *)malloc(bytes);
+
+  v->data = 0;
+  v->grad = 0;
+  v->tangent = 0;
+  v->children = borrow       ? no_grad_slots
+                : n_children ? (Value **)((unsigned char *)v + size)
+                             : NULL;
+  v->n_children = n_children;
+  v->reverse = NULL;
+  v->forward = NULL;
+  v->visit = 0;
+  v->op = op;
+  v->index = -1;
+  v->refs = 0;
+  v->flags = active_arena ? VALUE_ARENA : pooled ? VALUE_POOLED : 0;
+  STATS_NODE(op, bytes);
+
+  return v;
 }
 
-/** ********** OPERATORS ********** **/
+// plain node: a Value followed by its children slots
+static Value *make_node(Op op, int n_children) {
+  return make_node_sized(sizeof(Value), op, n_children);
+}
 
-/**
-  TODO: build operations (+, -, *, **, relu)
- */
+// set by forward_mode_enable; operators then also propagate `tangent`
+static _Thread_local int forward_mode = 0;
+static void node_tangent(Value *c);
+
+// tape that operators append to, set by tape_begin
+static _Thread_local struct SoAGraph *active_tape = NULL;
+static void tape_record(Value *c);
 
 /**
- @brief add two scalars and compute the gradient
- @param (a: Value) Value object
- @param (b: Value) Value object
- @returns new Value object "c" with the scalar = a + b where a,b are the
- children of c, and the gradient computed respectively
+ * @brief Completes an operator node once its children are filled in
+ *
+ * Takes a reference on every child, inherits VALUE_REQUIRES_GRAD from them,
+ * installs the node's forward and reverse functions and computes its value
+ * (and its tangent in forward mode). In no-grad mode it only computes the
+ * value (and tangent) and then turns the node into a leaf: no references,
+ * no functions, nothing recorded.
+ *
+ * @param res Node from make_node with all children slots set
+ * @param forward Forward function of the operation
+ * @param reverse Reverse function of the operation
+ * @return res
  */
-Value *add(Value *a, Value *b) {
-  Value *res = defaultValue(0);
-
-  res->data = a->data + b->data;
-  res->grad = 0;
+static Value *finish_node(Value *res, void (*forward)(Value *),
+                          void (*reverse)(Value *)) {
+  if (no_grad) {
+    forward(res);
+    if (forward_mode)
+      node_tangent(res);
+    res->children = NULL;
+    res->n_children = 0;
+    res->op = OP_LEAF;
+    return res;
+  }
 
-  res->children = (Value **)malloc(2 * sizeof(Value *));
-  res->children[0] = a;
-  res->children[1] = b;
-  res->n_children = 2;
+  for (int i = 0; i < res->n_children; i++) {
+    res->children[i]->refs++;
+    res->flags |= res->children[i]->flags & VALUE_REQUIRES_GRAD;
+  }
 
-  res->reverse = add_reverse; // gradient computed in add_backwards
+  res->forward = forward;
+  res->reverse = reverse;
+  res->forward(res);
+  if (forward_mode)
+    node_tangent(res);
+  if (active_tape)
+    tape_record(res);
 
   return res;
 }
 
 /**
- @brief subtract two scalars and compute the gradient
- @param (a: Value) Value object
- @param (b: Value) Value object
- @returns new Value object "c" with the scalar = a - b where a,b are the
- children of c, and the gradient computed respectively
+  @brief initialize Value object by floating point number
+  @param (x) number to be converted into a Value object
+  @returns Value object
  */
-Value *sub(Value *a, Value *b) {
-  Value *negB = defaultValue(-b->data);
-  return add(a, negB);
+Value *defaultValue(scalar_t x) {
+  Value *v = make_node(OP_LEAF, 0);
+  v->data = x;
+  v->flags |= VALUE_REQUIRES_GRAD;
+  return v;
 }
 
 /**
- @brief multiply two scalars and compute the gradient
- @param (a: Value) Value object
- @param (b: Value) Value object
- @returns new Value object "c" with the scalar = a * b where a,b are the
- children of c, and the gradient computed respectively
+  @brief initialize a constant leaf; unlike defaultValue it promises that
+  `data` never changes, so optimize_graph can fold it away
+  @param (x) value of the constant
+  @returns Value object
  */
-Value *mul(Value *a, Value *b) {
-  Value *res = defaultValue(0);
-
-  res->data = a->data * b->data;
-  res->grad = 0;
+Value *constValue(scalar_t x) {
+  Value *v = defaultValue(x);
+  v->flags = (v->flags | VALUE_CONST) & ~VALUE_REQUIRES_GRAD;
+  return v;
+}
 
-  res->children = (Value **)malloc(2 * sizeof(Value *));
-  res->children[0] = a;
-  res->children[1] = b;
-  res->n_children = 2;
+/**
+  @brief mark whether a leaf's gradient is wanted (e.g. 0 for data inputs);
+  only ops built afterwards see the change
+  @param (v: Value) leaf
+  @param (enabled: int) 1 to compute its gradient, 0 to prune it
+  @returns v
+ */
+Value *requires_grad(Value *v, int enabled) {
+  if (enabled)
+    v->flags |= VALUE_REQUIRES_GRAD;
+  else
+    v->flags &= ~VALUE_REQUIRES_GRAD;
+  return v;
+}
 
-  res->reverse = mul_reverse; // gradient computed in  mul_backward
+/** ********** UTILS ********** **/
 
-  return res;
+/**
+  @brief print value and gradient
+  @param (obj: Value) Value object
+ */
+void print(Value *obj) {
+  printf("Value: %f, Gradient: %f \n", obj->data, obj->grad);
 }
 
+/** ********** GRADIENT CLIPPING ********** **/
+
 /**
- @brief raise one scalar to the power of the other and compute the gradient
- @param (a: Value) Value object
- @param (b: Value) Value object
- @returns new Value object "c" with the scalar = a ^ b where a,b are the
- children of c, and the gradient computed respectively
+  @enum  ClipMode
+  @brief how gradients are clipped once a backward pass has finished
  */
-Value *pwr(Value *a, Value *b) {
-  Value *res = defaultValue(0);
+typedef enum ClipMode {
+  CLIP_NONE,  // leave gradients alone
+  CLIP_RANGE, // clamp every gradient to [min, max]
+  CLIP_NORM   // rescale so the L2 norm over all leaves is at most max_norm
+} ClipMode;
 
-  res->data = powf(a->data, b->data);
-  res->grad = 0;
+/**
+  @struct GradClip
+  @brief  Runtime gradient clipping configuration
+  @param (mode: ClipMode) clipping mode
+  @param (min: float) lower bound for CLIP_RANGE
+  @param (max: float) upper bound for CLIP_RANGE
+  @param (max_norm: float) largest allowed global norm for CLIP_NORM
+ */
+typedef struct GradClip {
+  ClipMode mode;
+  float min;
+  float max;
+  float max_norm;
+} GradClip;
 
-  res->children = (Value **)malloc(2 * sizeof(Value *));
-  res->children[0] = a;
-  res->children[1] = b;
-  res->n_children = 2;
+// limit the magnitude of the gradients; defaults to clamping to [-10, 10]
+static GradClip grad_clip_config = {CLIP_RANGE, -10.0f, 10.0f, 1.0f};
 
-  res->reverse = pwr_reverse; // gradient computed in  mul_backward
+/**
+  @brief set how the backward passes clip the gradients they produce
+  @param (clip: GradClip) new configuration
+  @returns the previous configuration
+ */
+GradClip set_grad_clip(GradClip clip) {
+  GradClip prev = grad_clip_config;
+  grad_clip_config = clip;
+  return prev;
+}
 
-  return res;
+/**
+  @brief clamp every element of a gradient buffer to [lo, hi]; branch-free
+  so it compiles to vector min/max
+  @param (g: [grad_t]) gradient buffer
+  @param (n: size_t) number of elements
+  @param (lo: grad_t) lower bound
+  @param (hi: grad_t) upper bound
+ */
+void clip_range(grad_t *g, size_t n, grad_t lo, grad_t hi) {
+  for (size_t i = 0; i < n; i++) {
+    grad_t x = g[i] < lo ? lo : g[i];
+    g[i] = x > hi ? hi : x;
+  }
 }
 
 /**
- @brief divide two scalars and compute the gradient
- @param (a: Value) Value object (numerator)
- @param (b: Value) Value object (denominator)
- @returns new Value object "c" with the scalar = a / b where a,b are the
- children of c, and the gradient computed respectively
+  @brief sum of squares of a buffer; eight partial sums keep the loop
+  vectorizable without reassociating float math
+  @param (g: [grad_t]) buffer
+  @param (n: size_t) number of elements
+  @returns sum of g[i]^2
  */
-Value *divide(Value *a, Value *b) {
-  Value *reciprocal = pwr(b, defaultValue(-1));
-  return mul(a, reciprocal);
+grad_t sum_squares(const grad_t *g, size_t n) {
+  grad_t acc[8] = {0};
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    for (int l = 0; l < 8; l++)
+      acc[l] += g[i + l] * g[i + l];
+
+  grad_t sum = 0;
+  for (; i < n; i++)
+    sum += g[i] * g[i];
+  for (int l = 0; l < 8; l++)
+    sum += acc[l];
+  return sum;
 }
 
 /**
- * @brief Applies the Rectified Linear Unit (ReLU) activation function to a
- * Value object
+  @brief multiply every element of a buffer by `s`
+  @param (g: [grad_t]) buffer
+  @param (n: size_t) number of elements
+  @param (s: grad_t) scale factor
+ */
+void scale_buffer(grad_t *g, size_t n, grad_t s) {
+  for (size_t i = 0; i < n; i++)
+    g[i] *= s;
+}
+
+/**
+ * @brief Clips a contiguous gradient buffer by its global L2 norm
  *
- * The ReLU function is defined as f(x) = max(0, x). It returns x if x is
- * positive, and 0 otherwise. This non-linear activation function is commonly
- * used in neural networks to introduce non-linearity into the model.
+ * @param g Gradient buffer
+ * @param n Number of elements
+ * @param max_norm Largest allowed norm
+ * @return Norm before clipping
+ */
+grad_t clip_norm(grad_t *g, size_t n, grad_t max_norm) {
+  grad_t norm = SQRT(sum_squares(g, n));
+  if (norm > max_norm)
+    scale_buffer(g, n, max_norm / norm);
+  return norm;
+}
+
+/**
+ @brief clips the gradient if it exceeds the configured range
+ @param (obj: Value) Value object
+*/
+void grad_clip(Value *obj) {
+  clip_range(&obj->grad, 1, grad_clip_config.min, grad_clip_config.max);
+}
+
+// 1 if clipping applies to v: a leaf whose gradient is wanted
+static int clip_target(const Value *v) {
+  return !v->n_children && (v->flags & VALUE_REQUIRES_GRAD);
+}
+
+/**
+ * @brief Applies the clipping configuration to the leaves of a sorted graph
  *
- * @param a Pointer to the input Value object
- * @return Pointer to a new Value object containing the result of the ReLU
- * operation
+ * Runs once after a backward pass, so clipping sees the final accumulated
+ * gradients instead of partial sums. Only leaves are touched: their
+ * gradients are the ones that get applied; inner gradients have already
+ * been consumed. Leaves without VALUE_REQUIRES_GRAD are skipped, so a full
+ * order (graph_backward) clips the same leaves as a pruned one (reverse).
+ * Each leaf's grad lives inline in its own node, so there is no buffer to
+ * hand to clip_range and this stays a scalar walk over the order, with the
+ * bounds read once.
+ *
+ * @param order Sorted nodes
+ * @param n Number of nodes
  */
-Value *relu(Value *a) {
-  Value *res = defaultValue(0);
+static void clip_leaves(Value **order, int n) {
+  GradClip clip = grad_clip_config;
 
-  res->data = (a->data > 0) ? a->data : 0;
-  res->grad = 0;
+  if (clip.mode == CLIP_RANGE) {
+    grad_t lo = clip.min, hi = clip.max;
+    for (int i = 0; i < n; i++)
+      if (clip_target(order[i])) {
+        grad_t x = order[i]->grad < lo ? lo : order[i]->grad;
+        order[i]->grad = x > hi ? hi : x;
+      }
+  } else if (clip.mode == CLIP_NORM) {
+    grad_t sum = 0;
+    for (int i = 0; i < n; i++)
+      if (clip_target(order[i]))
+        sum += order[i]->grad * order[i]->grad;
 
-  res->children = (Value **)malloc(sizeof(Value *));
-  res->children[0] = a;
-  res->n_children = 1;
+    grad_t norm = SQRT(sum);
+    if (norm > clip.max_norm) {
+      grad_t s = clip.max_norm / norm;
+      for (int i = 0; i < n; i++)
+        if (clip_target(order[i]))
+          order[i]->grad *= s;
+    }
+  }
+}
 
-  res->reverse = relu_reverse;
+// set on the threads taking part in a parallel reverse_parallel pass (its
+// caller for the duration, pool workers for good); makes grad_acc
+// thread-safe there without slowing down plain reverse on other threads
+static _Thread_local int parallel_backward = 0;
 
-  return res;
+/**
+ * @brief Accumulates `g` into a node's gradient
+ *
+ * Every reverse function funnels its writes through here. During a parallel
+ * backward pass two nodes of the same level may share a child, so the
+ * update becomes a compare-and-swap loop on the gradient.
+ *
+ * @param obj Pointer to the Value receiving gradient
+ * @param g Partial gradient to add
+ */
+static inline void grad_acc(Value *obj, grad_t g) {
+  if (!parallel_backward) {
+    obj->grad += g;
+    return;
+  }
+
+  grad_t old, sum;
+  __atomic_load(&obj->grad, &old, __ATOMIC_RELAXED);
+  do {
+    sum = old + g;
+  } while (!__atomic_compare_exchange(&obj->grad, &old, &sum, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Frees a single Value node
+ *
+ * Drops the node's reference on each of its children but leaves the
+ * children themselves alone; the children array lives inside the node and
+ * goes with it. Use free_graph to release a whole graph. Nodes drawn from an
+ * Arena are left for arena_reset, owned nodes for their owner, and small
+ * nodes go back to the calling thread's node pool when it is enabled.
+ *
+ * @param val Pointer to the Value node to be freed
+ */
+void free_node(Value *val) {
+  for (int i = 0; i < val->n_children; i++)
+    val->children[i]->refs--;
+
+  if (val->flags & (VALUE_ARENA | VALUE_OWNED))
+    return;
+  if ((val->flags & VALUE_POOLED) && node_pool_push(val))
+    return;
+  free(val);
+}
+
+/** ********** BACKPASS LOGIC ********** **/
+
+// epoch of the most recent topological sort; nodes start at 0 (never seen).
+// Atomic so sorts on different threads never get the same epoch, even when
+// a graph later moves to another thread.
+static _Atomic unsigned int dag_epoch = 0;
+
+/**
+  @brief start a new topological sort; every node whose `visit` differs from
+  the returned epoch counts as unvisited
+  @returns fresh epoch, never 0
+ */
+unsigned int next_epoch(void) {
+  unsigned int epoch;
+  do
+    epoch = atomic_fetch_add(&dag_epoch, 1) + 1;
+  while (epoch == 0);
+  return epoch;
+}
+
+/**
+  @struct TopoFrame
+  @brief  Explicit DFS stack entry used by build_dag
+  @param (node: Value) node being expanded
+  @param (next: int) index of the next child to visit
+ */
+typedef struct TopoFrame {
+  Value *node;
+  int next;
+} TopoFrame;
+
+/**
+  @struct Topo
+  @brief  Reusable, heap-backed topological order of a graph
+  @param (order: [Value]) nodes sorted so children come before parents
+  @param (size: int) number of nodes in order
+  @param (cap: int) capacity of order
+  @param (stack: [TopoFrame]) DFS stack, kept between calls
+  @param (stack_cap: int) capacity of stack
+ */
+typedef struct Topo {
+  Value **order;
+  int size;
+  int cap;
+
+  TopoFrame *stack;
+  int stack_cap;
+} Topo;
+
+/**
+  @brief initialize an empty Topo; buffers are allocated on first use
+  @param (topo: Topo) Topo object
+ */
+void topo_init(Topo *topo) {
+  topo->order = NULL;
+  topo->size = 0;
+  topo->cap = 0;
+  topo->stack = NULL;
+  topo->stack_cap = 0;
+}
+
+/**
+  @brief free the buffers held by a Topo
+  @param (topo: Topo) Topo object
+ */
+void topo_free(Topo *topo) {
+  free(topo->order);
+  free(topo->stack);
+  topo_init(topo);
+}
+
+// grow `*buf` (of `*cap` elements of `elem` bytes) to hold at least `need`
+static int grow_buffer(void **buf, int *cap, int need, size_t elem) {
+  if (need <= *cap)
+    return 0;
+
+  int new_cap = *cap ? *cap : TOPO_INIT_CAP;
+  while (new_cap < need)
+    new_cap *= 2;
+
+  void *grown = realloc(*buf, (size_t)new_cap * elem);
+  if (!grown)
+    return -1;
+  *buf = grown;
+  *cap = new_cap;
+  return 0;
+}
+
+/**
+ * @brief Builds a Directed Acyclic Graph (DAG) and topologically sorts it
+ *
+ * This function constructs a DAG from the given Value object and its children,
+ * then performs a topological sort on the graph. It's a crucial helper for the
+ * reverse pass in backpropagation, ensuring that gradients are computed in the
+ * correct order. A node is marked visited by stamping it with the current
+ * epoch, so each node is examined once and the sort runs in linear time.
+ *
+ * The depth-first search keeps its own stack on the heap, so deep chains do
+ * not overflow the C stack. The order and stack buffers grow geometrically and
+ * are kept in `topo`, so sorting through the same Topo again allocates nothing
+ * once it has seen a graph of that size.
+ *
+ * @param root Pointer to the root Value object
+ * @param topo Topo receiving the sorted nodes in `order[0..size)`
+ * @param need Flags a child must carry to be visited (0 for every node)
+ * @return Number of nodes in the DAG, or -1 if out of memory
+ */
+static int topo_sort(Value *root, Topo *topo, unsigned int need) {
+  unsigned int epoch = next_epoch();
+  int sp = 0;
+
+  topo->size = 0;
+  if (grow_buffer((void **)&topo->stack, &topo->stack_cap, 1,
+                  sizeof(TopoFrame)))
+    return -1;
+
+  root->visit = epoch;
+  topo->stack[sp].node = root;
+  topo->stack[sp].next = 0;
+  sp++;
+
+  while (sp > 0) {
+    TopoFrame *frame = &topo->stack[sp - 1];
+    Value *node = frame->node;
+
+    if (frame->next < node->n_children) {
+      Value *child = node->children[frame->next++];
+      if (child->visit == epoch || (child->flags & need) != need)
+        continue;
+      child->visit = epoch;
+
+      if (grow_buffer((void **)&topo->stack, &topo->stack_cap, sp + 1,
+                      sizeof(TopoFrame)))
+        return -1;
+      topo->stack[sp].node = child;
+      topo->stack[sp].next = 0;
+      sp++;
+    } else {
+      if (grow_buffer((void **)&topo->order, &topo->cap, topo->size + 1,
+                      sizeof(Value *)))
+        return -1;
+      topo->order[topo->size++] = node;
+      sp--;
+    }
+  }
+
+  return topo->size;
+}
+
+/**
+  @brief topologically sort every node below `root` (see topo_sort)
+  @param (root: Value) root of the graph
+  @param (topo: Topo) receives the order
+  @returns number of nodes, or -1 if out of memory
+ */
+int build_dag(Value *root, Topo *topo) { return topo_sort(root, topo, 0); }
+
+/**
+  @brief topologically sort only the nodes below `root` whose gradient is
+  wanted; subgraphs without VALUE_REQUIRES_GRAD are never entered
+  @param (root: Value) root of the graph
+  @param (topo: Topo) receives the order
+  @returns number of nodes, or -1 if out of memory
+ */
+int build_grad_dag(Value *root, Topo *topo) {
+  return topo_sort(root, topo, VALUE_REQUIRES_GRAD);
+}
+
+/**
+ * @brief Performs the reverse pass using a caller-owned topological order
+ *
+ * Same as reverse, but sorts into `topo` so callers running several graphs
+ * (or threads) can each keep a warmed-up buffer.
+ *
+ * @param root Pointer to the root Value object of the computational graph
+ * @param topo Topo reused across calls
+ */
+void reverse_topo(Value *root, Topo *topo) {
+  if (build_grad_dag(root, topo) < 0)
+    return;
+  root->grad = 1.0;
+
+  Value **dag = topo->order;
+  for (int i = topo->size - 1; i >= 0; i--) {
+    if (dag[i]->reverse)
+      REVERSE_NODE(dag[i]);
+  }
+  clip_leaves(dag, topo->size);
+}
+
+/**
+ * @brief Performs the reverse pass (backpropagation) on a computational graph
+ *
+ * This function executes the backward pass of automatic differentiation.
+ * It builds a topologically sorted DAG, initializes the gradient of the root
+ * node to 1.0, and then propagates the gradients backward through the graph,
+ * calling each node's reverse function to compute partial derivatives. The
+ * sorted order lives in a per-thread buffer that is reused by every call, so
+ * threads can run backward on separate graphs at the same time.
+ *
+ * @param root Pointer to the root Value object of the computational graph
+ */
+void reverse(Value *root) {
+  static _Thread_local Topo topo = {NULL, 0, 0, NULL, 0};
+  reverse_topo(root, &topo);
+}
+
+/** ********** TEARDOWN ********** **/
+
+/**
+ * @brief Frees `root` and every node below it that nothing else references
+ *
+ * Walks the topological order once, parents first. By the time a node is
+ * reached every parent inside the graph has already been released, so its
+ * `refs` counts only outside holders: shared subexpressions still used by
+ * another graph and retained nodes (e.g. parameters) survive, everything
+ * else is freed exactly once. Graphs built without any value_retain calls
+ * are freed completely.
+ *
+ * @param root Pointer to the root Value object of the computational graph
+ */
+void free_graph(Value *root) {
+  static _Thread_local Topo topo = {NULL, 0, 0, NULL, 0};
+  if (root->refs > 0 || build_dag(root, &topo) < 0)
+    return;
+
+  for (int i = topo.size - 1; i >= 0; i--) {
+    Value *v = topo.order[i];
+    if (v->refs > 0)
+      continue;
+    free_node(v);
+  }
+}
+
+/**
+  @brief take a reference on a node so free_graph keeps it alive
+  @param (v: Value) Value object
+  @returns v
+ */
+Value *value_retain(Value *v) {
+  v->refs++;
+  return v;
+}
+
+/**
+  @brief drop a reference taken with value_retain; frees the node and its
+  unreferenced subgraph once nothing holds it anymore
+  @param (v: Value) Value object
+ */
+void value_release(Value *v) {
+  if (--v->refs <= 0) {
+    v->refs = 0;
+    free_graph(v);
+  }
+}
+
+/**
+   Forward pass functions for each operation; they recompute
+   `data` from the children and are shared by the operators and graph replay
+*/
+
+void add_forward(Value *c) {
+  c->data = c->children[0]->data + c->children[1]->data;
+}
+
+void mul_forward(Value *c) {
+  c->data = c->children[0]->data * c->children[1]->data;
+}
+
+void pwr_forward(Value *c) {
+  c->data = POW(c->children[0]->data, c->children[1]->data);
+}
+
+void relu_forward(Value *c) {
+  scalar_t a = c->children[0]->data;
+  c->data = (a > 0) ? a : 0;
+}
+
+void neg_forward(Value *c) { c->data = -c->children[0]->data; }
+
+void sub_forward(Value *c) {
+  c->data = c->children[0]->data - c->children[1]->data;
+}
+
+void div_forward(Value *c) {
+  c->data = c->children[0]->data / c->children[1]->data;
+}
+
+void mul_add_forward(Value *c) {
+  c->data = c->children[0]->data * c->children[1]->data + c->children[2]->data;
+}
+
+// children are w[0..n), x[0..n), b
+void linear_forward(Value *c) {
+  int n = (c->n_children - 1) / 2;
+  Value **w = c->children;
+  Value **x = c->children + n;
+
+  scalar_t z = c->children[2 * n]->data;
+  for (int i = 0; i < n; i++)
+    z += w[i]->data * x[i]->data;
+  c->data = z;
+}
+
+void linear_relu_forward(Value *c) {
+  linear_forward(c);
+  c->data = (c->data > 0) ? c->data : 0;
+}
+
+void sum_forward(Value *c) {
+  scalar_t s = 0;
+  for (int i = 0; i < c->n_children; i++)
+    s += c->children[i]->data;
+  c->data = s;
+}
+
+void mean_forward(Value *c) {
+  sum_forward(c);
+  c->data /= c->n_children;
+}
+
+// children are a[0..n), b[0..n)
+void dot_forward(Value *c) {
+  int n = c->n_children / 2;
+  Value **a = c->children;
+  Value **b = c->children + n;
+
+  scalar_t s = 0;
+  for (int i = 0; i < n; i++)
+    s += a[i]->data * b[i]->data;
+  c->data = s;
+}
+
+void exp_forward(Value *c) { c->data = EXP(c->children[0]->data); }
+
+void log_forward(Value *c) { c->data = LOG(c->children[0]->data); }
+
+void tanh_forward(Value *c) { c->data = TANH(c->children[0]->data); }
+
+void sigmoid_forward(Value *c) {
+  c->data = 1 / (1 + EXP(-c->children[0]->data));
+}
+
+/**
+  @struct SoftmaxCEValue
+  @brief  softmax_cross_entropy node; caches the log-sum-exp of the logits so
+  the reverse pass gets every softmax probability from one exp
+  @param (node: Value) node itself; children are z[0..n), y[0..n)
+  @param (lse: scalar_t) log(sum_i exp(z_i))
+ */
+typedef struct SoftmaxCEValue {
+  Value node;
+  scalar_t lse;
+} SoftmaxCEValue;
+
+// log(sum_i exp(z_i)), shifted by the max so no exp overflows
+static scalar_t log_sum_exp(Value **z, int n) {
+  scalar_t m = z[0]->data;
+  for (int i = 1; i < n; i++)
+    m = z[i]->data > m ? z[i]->data : m;
+  scalar_t s = 0;
+  for (int i = 0; i < n; i++)
+    s += EXP(z[i]->data - m);
+  return m + LOG(s);
+}
+
+// -sum_i y_i log softmax(z)_i = sum_i y_i (lse - z_i)
+void softmax_ce_forward(Value *c) {
+  int n = c->n_children / 2;
+  Value **z = c->children;
+  Value **y = c->children + n;
+
+  scalar_t lse = log_sum_exp(z, n);
+
+  scalar_t loss = 0;
+  for (int i = 0; i < n; i++)
+    loss += y[i]->data * (lse - z[i]->data);
+  ((SoftmaxCEValue *)c)->lse = lse;
+  c->data = loss;
+}
+
+/**
+   Reverse pass functions for each operation (+, -, *, **, relu)
+*/
+
+/**
+ @brief computes gradient after completing add operation (backprop)
+ @param (c : Value) Value object
+ */
+void add_reverse(Value *c) {
+  grad_acc(c->children[0], c->grad);
+  grad_acc(c->children[1], c->grad);
+}
+
+/**
+ @brief computes gradient after completing multiplication operation (backprop)
+ @param (c : Value) Value object
+
+ - Note after backpropagating, dc/da = grad of c * b
+ - Similarly, dc/db = grad of c * a
+ */
+void mul_reverse(Value *c) {
+  grad_acc(c->children[0], c->grad * c->children[1]->data);
+  grad_acc(c->children[1], c->grad * c->children[0]->data);
+}
+
+/**
+ @brief computes gradient after completing power operation (backprop)
+ @param (c : Value) Value object
+
+ - dc/da = b * a^(b-1)
+ - dc/db = log(a) * a^b
+
+ After backpropagating, the final gradient:
+ - dc/da = b * a^(b-1) * grad of c
+ - dc/db = c * log(a) * grad of c
+ */
+void pwr_reverse(Value *c) {
+  Value *a = c->children[0];
+  Value *b = c->children[1];
+
+  grad_acc(a, b->data * POW(a->data, b->data - 1) * c->grad);
+
+  // note: check needed bc log(a) is undefined for a <= 0
+  if (a->data > 0)
+    grad_acc(b, LOG(a->data) * c->data * c->grad);
+}
+
+/**
+ * @brief Computes gradient for ReLU function during backpropagation
+ *
+ * This function calculates the gradient for the Rectified Linear Unit (ReLU)
+ * activation during the backward pass of backpropagation. ReLU's gradient is 1
+ * for positive inputs and 0 for negative or zero inputs. This preserves the
+ * gradient for active (positive) neurons while blocking it for inactive ones.
+ *
+ * @param c Pointer to the Value object representing the ReLU operation
+ */
+void relu_reverse(Value *c) {
+  Value *a = c->children[0];
+  grad_acc(a, (a->data > 0) ? c->grad : 0);
+}
+
+/**
+ @brief computes gradient after completing negation (backprop)
+ @param (c : Value) Value object
+ */
+void neg_reverse(Value *c) {
+  grad_acc(c->children[0], -c->grad);
+}
+
+/**
+ @brief computes gradient after completing subtraction (backprop)
+ @param (c : Value) Value object
+
+ - dc/da = grad of c
+ - dc/db = -grad of c
+ */
+void sub_reverse(Value *c) {
+  grad_acc(c->children[0], c->grad);
+  grad_acc(c->children[1], -c->grad);
+}
+
+/**
+ @brief computes gradient after completing division (backprop)
+ @param (c : Value) Value object
+
+ - dc/da = grad of c / b
+ - dc/db = -grad of c * a / b^2 = -grad of c * c / b
+ */
+void div_reverse(Value *c) {
+  Value *a = c->children[0];
+  Value *b = c->children[1];
+
+  grad_acc(a, c->grad / b->data);
+  grad_acc(b, -c->grad * c->data / b->data);
+}
+
+/**
+ @brief computes gradient after completing fused a * b + d (backprop)
+ @param (c : Value) Value object
+ */
+void mul_add_reverse(Value *c) {
+  grad_acc(c->children[0], c->grad * c->children[1]->data);
+  grad_acc(c->children[1], c->grad * c->children[0]->data);
+  grad_acc(c->children[2], c->grad);
+}
+
+/**
+ * @brief Computes gradient of b + sum_i w_i * x_i (backprop)
+ *
+ * dw_i = grad * x_i, dx_i = grad * w_i and db = grad.
+ *
+ * @param c Pointer to the Value object representing the fused dot product
+ */
+void linear_reverse(Value *c) {
+  int n = (c->n_children - 1) / 2;
+  Value **w = c->children;
+  Value **x = c->children + n;
+  Value *b = c->children[2 * n];
+
+  for (int i = 0; i < n; i++) {
+    grad_acc(w[i], c->grad * x[i]->data);
+    grad_acc(x[i], c->grad * w[i]->data);
+  }
+  grad_acc(b, c->grad);
+}
+
+/**
+ * @brief Computes gradient of relu(b + sum_i w_i * x_i) (backprop)
+ *
+ * The ReLU gate is read from the cached output: if it is 0 no gradient
+ * flows; otherwise the gradients are those of linear_reverse.
+ *
+ * @param c Pointer to the Value object representing the fused neuron
+ */
+void linear_relu_reverse(Value *c) {
+  if (c->data <= 0)
+    return;
+  linear_reverse(c);
+}
+
+/**
+ @brief computes gradient of an n-ary sum (backprop): every child gets
+ grad of c
+ @param (c : Value) Value object
+ */
+void sum_reverse(Value *c) {
+  for (int i = 0; i < c->n_children; i++)
+    grad_acc(c->children[i], c->grad);
+}
+
+/**
+ @brief computes gradient of an n-ary mean (backprop): every child gets
+ grad of c / n
+ @param (c : Value) Value object
+ */
+void mean_reverse(Value *c) {
+  grad_t g = c->grad / c->n_children;
+  for (int i = 0; i < c->n_children; i++)
+    grad_acc(c->children[i], g);
+}
+
+/**
+ @brief computes gradient of sum_i a_i * b_i (backprop)
+ @param (c : Value) Value object
+
+ - da_i = grad of c * b_i
+ - db_i = grad of c * a_i
+ */
+void dot_reverse(Value *c) {
+  int n = c->n_children / 2;
+  Value **a = c->children;
+  Value **b = c->children + n;
+
+  for (int i = 0; i < n; i++) {
+    grad_acc(a[i], c->grad * b[i]->data);
+    grad_acc(b[i], c->grad * a[i]->data);
+  }
+}
+
+/**
+ @brief computes gradient of exp(a) (backprop): da = grad of c * c, reusing
+ the cached output
+ @param (c : Value) Value object
+ */
+void exp_reverse(Value *c) { grad_acc(c->children[0], c->grad * c->data); }
+
+/**
+ @brief computes gradient of log(a) (backprop): da = grad of c / a
+ @param (c : Value) Value object
+ */
+void log_reverse(Value *c) {
+  grad_acc(c->children[0], c->grad / c->children[0]->data);
+}
+
+/**
+ @brief computes gradient of tanh(a) (backprop): da = grad of c * (1 - c^2)
+ @param (c : Value) Value object
+ */
+void tanh_reverse(Value *c) {
+  grad_acc(c->children[0], c->grad * (1 - c->data * c->data));
+}
+
+/**
+ @brief computes gradient of sigmoid(a) (backprop): da = grad of c * c *
+ (1 - c)
+ @param (c : Value) Value object
+ */
+void sigmoid_reverse(Value *c) {
+  grad_acc(c->children[0], c->grad * c->data * (1 - c->data));
+}
+
+/**
+ * @brief Computes gradient of softmax cross-entropy (backprop)
+ *
+ * With p_i = exp(z_i - lse) from the cached log-sum-exp and S = sum_i y_i:
+ * - dz_i = grad of c * (p_i * S - y_i)
+ * - dy_i = grad of c * (lse - z_i)
+ *
+ * @param c Pointer to the softmax_cross_entropy node
+ */
+void softmax_ce_reverse(Value *c) {
+  int n = c->n_children / 2;
+  Value **z = c->children;
+  Value **y = c->children + n;
+  scalar_t lse = ((SoftmaxCEValue *)c)->lse;
+
+  scalar_t total = 0;
+  for (int i = 0; i < n; i++)
+    total += y[i]->data;
+  for (int i = 0; i < n; i++) {
+    grad_acc(z[i], c->grad * (EXP(z[i]->data - lse) * total - y[i]->data));
+    grad_acc(y[i], c->grad * (lse - z[i]->data));
+  }
+}
+
+/** ********** FORWARD MODE ********** **/
+
+/**
+ * @brief Switches forward-mode differentiation on or off for this thread
+ *
+ * While on, every operator computes its output's `tangent` from its
+ * children's tangents as it is built, so seeding the inputs' tangents with a
+ * direction v yields J * v at every node in the same pass: no tape, no
+ * topological sort and no reverse pass. graph_forward propagates tangents
+ * as well.
+ *
+ * @param enabled 1 to propagate tangents, 0 to stop
+ */
+void forward_mode_enable(int enabled) { forward_mode = enabled; }
+
+/**
+ * @brief Computes a node's tangent from its children's (dual numbers)
+ *
+ * Applies the same partial derivatives as the reverse functions, but
+ * pushes them forward: dc = sum_i dc/da_i * tangent of a_i. OP_CUSTOM nodes
+ * keep the tangent their forward function computed (checkpoint_forward
+ * replays its segment in forward mode).
+ *
+ * @param c Pointer to a node whose data is already computed
+ */
+static void node_tangent(Value *c) {
+  Value **ch = c->children;
+
+  switch (c->op) {
+  case OP_ADD:
+    c->tangent = ch[0]->tangent + ch[1]->tangent;
+    break;
+  case OP_MUL:
+    c->tangent = ch[0]->tangent * ch[1]->data + ch[0]->data * ch[1]->tangent;
+    break;
+  case OP_PWR: {
+    scalar_t a = ch[0]->data, b = ch[1]->data;
+    c->tangent = b * POW(a, b - 1) * ch[0]->tangent;
+    if (a > 0)
+      c->tangent += LOG(a) * c->data * ch[1]->tangent;
+    break;
+  }
+  case OP_RELU:
+    c->tangent = ch[0]->data > 0 ? ch[0]->tangent : 0;
+    break;
+  case OP_NEG:
+    c->tangent = -ch[0]->tangent;
+    break;
+  case OP_SUB:
+    c->tangent = ch[0]->tangent - ch[1]->tangent;
+    break;
+  case OP_DIV:
+    c->tangent = (ch[0]->tangent - c->data * ch[1]->tangent) / ch[1]->data;
+    break;
+  case OP_MUL_ADD:
+    c->tangent = ch[0]->tangent * ch[1]->data +
+                 ch[0]->data * ch[1]->tangent + ch[2]->tangent;
+    break;
+  case OP_LINEAR:
+  case OP_LINEAR_RELU: {
+    int n = (c->n_children - 1) / 2;
+    scalar_t t = 0;
+    if (c->op == OP_LINEAR || c->data > 0) {
+      t = ch[2 * n]->tangent;
+      for (int i = 0; i < n; i++)
+        t += ch[i]->tangent * ch[n + i]->data +
+             ch[i]->data * ch[n + i]->tangent;
+    }
+    c->tangent = t;
+    break;
+  }
+  case OP_SUM:
+  case OP_MEAN: {
+    scalar_t t = 0;
+    for (int i = 0; i < c->n_children; i++)
+      t += ch[i]->tangent;
+    c->tangent = c->op == OP_MEAN ? t / c->n_children : t;
+    break;
+  }
+  case OP_DOT: {
+    int n = c->n_children / 2;
+    scalar_t t = 0;
+    for (int i = 0; i < n; i++)
+      t += ch[i]->tangent * ch[n + i]->data + ch[i]->data * ch[n + i]->tangent;
+    c->tangent = t;
+    break;
+  }
+  case OP_EXP:
+    c->tangent = c->data * ch[0]->tangent;
+    break;
+  case OP_LOG:
+    c->tangent = ch[0]->tangent / ch[0]->data;
+    break;
+  case OP_TANH:
+    c->tangent = (1 - c->data * c->data) * ch[0]->tangent;
+    break;
+  case OP_SIGMOID:
+    c->tangent = c->data * (1 - c->data) * ch[0]->tangent;
+    break;
+  case OP_SOFTMAX_CE: {
+    int n = c->n_children / 2;
+    scalar_t lse = ((SoftmaxCEValue *)c)->lse, total = 0, t = 0;
+    for (int i = 0; i < n; i++)
+      total += ch[n + i]->data;
+    for (int i = 0; i < n; i++)
+      t += (EXP(ch[i]->data - lse) * total - ch[n + i]->data) *
+               ch[i]->tangent +
+           (lse - ch[i]->data) * ch[n + i]->tangent;
+    c->tangent = t;
+    break;
+  }
+  case OP_CUSTOM:
+    break;
+  default:
+    if (c->n_children)
+      c->tangent = 0;
+    break;
+  }
+}
+
+/** ********** NO-GRAD MODE ********** **/
+
+/**
+ * @brief Switches no-grad (inference) mode on or off for this thread
+ *
+ * While on, operators compute `data` (and `tangent` in forward mode) from
+ * their inputs and return a plain leaf. No children are stored, no
+ * references are taken, and nothing is recorded on a tape, so an
+ * intermediate is garbage as soon as the caller drops it. Every result is
+ * a single sizeof(Value) block: it comes from the active arena, or from the
+ * node pool's leaf class when it is enabled, so freeing (or resetting) the
+ * intermediates of one request recycles them for the next.
+ *
+ * @param enabled 1 to stop building graphs, 0 to build them again
+ * @return The previous setting, so scopes can nest
+ */
+int no_grad_enable(int enabled) {
+  int prev = no_grad;
+  no_grad = enabled;
+  return prev;
+}
+
+/** ********** OPERATORS ********** **/
+
+/**
+  TODO: build operations (+, -, *, **, relu)
+ */
+
+/**
+ @brief add two scalars and compute the gradient
+ @param (a: Value) Value object
+ @param (b: Value) Value object
+ @returns new Value object "c" with the scalar = a + b where a,b are the
+ children of c, and the gradient computed respectively
+ */
+Value *add(Value *a, Value *b) {
+  Value *res = make_node(OP_ADD, 2);
+
+  res->children[0] = a;
+  res->children[1] = b;
+  return finish_node(res, add_forward, add_reverse);
+}
+
+/**
+ @brief subtract two scalars and compute the gradient
+ @param (a: Value) Value object
+ @param (b: Value) Value object
+ @returns new Value object "c" with the scalar = a - b where a,b are the
+ children of c, and the gradient computed respectively
+ */
+Value *sub(Value *a, Value *b) {
+  Value *res = make_node(OP_SUB, 2);
+
+  res->children[0] = a;
+  res->children[1] = b;
+  return finish_node(res, sub_forward, sub_reverse);
+}
+
+/**
+ @brief negate a scalar and compute the gradient
+ @param (a: Value) Value object
+ @returns new Value object "c" with the scalar = -a
+ */
+Value *neg(Value *a) {
+  Value *res = make_node(OP_NEG, 1);
+
+  res->children[0] = a;
+  return finish_node(res, neg_forward, neg_reverse);
+}
+
+/**
+ @brief multiply two scalars and compute the gradient
+ @param (a: Value) Value object
+ @param (b: Value) Value object
+ @returns new Value object "c" with the scalar = a * b where a,b are the
+ children of c, and the gradient computed respectively
+ */
+Value *mul(Value *a, Value *b) {
+  Value *res = make_node(OP_MUL, 2);
+
+  res->children[0] = a;
+  res->children[1] = b;
+  return finish_node(res, mul_forward, mul_reverse);
+}
+
+/**
+ @brief raise one scalar to the power of the other and compute the gradient
+ @param (a: Value) Value object
+ @param (b: Value) Value object
+ @returns new Value object "c" with the scalar = a ^ b where a,b are the
+ children of c, and the gradient computed respectively
+ */
+Value *pwr(Value *a, Value *b) {
+  Value *res = make_node(OP_PWR, 2);
+
+  res->children[0] = a;
+  res->children[1] = b;
+  return finish_node(res, pwr_forward, pwr_reverse);
+}
+
+/**
+ @brief divide two scalars and compute the gradient
+ @param (a: Value) Value object (numerator)
+ @param (b: Value) Value object (denominator)
+ @returns new Value object "c" with the scalar = a / b where a,b are the
+ children of c, and the gradient computed respectively
+ */
+Value *divide(Value *a, Value *b) {
+  Value *res = make_node(OP_DIV, 2);
+
+  res->children[0] = a;
+  res->children[1] = b;
+  return finish_node(res, div_forward, div_reverse);
+}
+
+/**
+ @brief fused multiply-add of three scalars in a single node (named to stay
+ clear of C99 fma)
+ @param (a: Value) Value object
+ @param (b: Value) Value object
+ @param (d: Value) Value object
+ @returns new Value object "c" with the scalar = a * b + d
+ */
+Value *mul_add(Value *a, Value *b, Value *d) {
+  Value *res = make_node(OP_MUL_ADD, 3);
+
+  res->children[0] = a;
+  res->children[1] = b;
+  res->children[2] = d;
+  return finish_node(res, mul_add_forward, mul_add_reverse);
+}
+
+/**
+ * @brief Applies the Rectified Linear Unit (ReLU) activation function to a
+ * Value object
+ *
+ * The ReLU function is defined as f(x) = max(0, x). It returns x if x is
+ * positive, and 0 otherwise. This non-linear activation function is commonly
+ * used in neural networks to introduce non-linearity into the model.
+ *
+ * @param a Pointer to the input Value object
+ * @return Pointer to a new Value object containing the result of the ReLU
+ * operation
+ */
+Value *relu(Value *a) {
+  Value *res = make_node(OP_RELU, 1);
+
+  res->children[0] = a;
+  return finish_node(res, relu_forward, relu_reverse);
+}
+
+/**
+ * @brief Fused neuron relu(b + sum_i w_i * x_i) as a single node
+ *
+ * Replaces the 2n + 1 mul/add nodes plus the relu node of a hand-built
+ * neuron with one node holding all 2n + 1 inputs as children.
+ *
+ * @param w Array of n weight Values
+ * @param x Array of n input Values
+ * @param b Bias Value
+ * @param n Fan-in
+ * @return Pointer to the new Value object
+ */
+Value *linear_relu(Value **w, Value **x, Value *b, int n) {
+  Value *res = make_node(OP_LINEAR_RELU, 2 * n + 1);
+
+  for (int i = 0; i < n; i++) {
+    res->children[i] = w[i];
+    res->children[n + i] = x[i];
+  }
+  res->children[2 * n] = b;
+  return finish_node(res, linear_relu_forward, linear_relu_reverse);
+}
+
+/**
+ * @brief Fused dot product b + sum_i w_i * x_i as a single node
+ *
+ * Same layout as linear_relu without the gate; used for output layers.
+ *
+ * @param w Array of n weight Values
+ * @param x Array of n input Values
+ * @param b Bias Value
+ * @param n Fan-in
+ * @return Pointer to the new Value object
+ */
+Value *linear(Value **w, Value **x, Value *b, int n) {
+  Value *res = make_node(OP_LINEAR, 2 * n + 1);
+
+  for (int i = 0; i < n; i++) {
+    res->children[i] = w[i];
+    res->children[n + i] = x[i];
+  }
+  res->children[2 * n] = b;
+  return finish_node(res, linear_forward, linear_reverse);
+}
+
+/**
+ * @brief n-ary sum of `x` as a single node
+ *
+ * Replaces a depth-n chain of binary add nodes with one node holding all n
+ * inputs as children; its reverse hands grad to every child in one loop.
+ *
+ * @param x Array of n Values
+ * @param n Number of inputs (at least 1)
+ * @return Pointer to the new Value object
+ */
+Value *sum(Value **x, int n) {
+  Value *res = make_node(OP_SUM, n);
+
+  for (int i = 0; i < n; i++)
+    res->children[i] = x[i];
+  return finish_node(res, sum_forward, sum_reverse);
+}
+
+/**
+ * @brief n-ary mean of `x` as a single node (see sum)
+ *
+ * @param x Array of n Values
+ * @param n Number of inputs (at least 1)
+ * @return Pointer to the new Value object
+ */
+Value *mean(Value **x, int n) {
+  Value *res = make_node(OP_MEAN, n);
+
+  for (int i = 0; i < n; i++)
+    res->children[i] = x[i];
+  return finish_node(res, mean_forward, mean_reverse);
+}
+
+/**
+ * @brief Dot product sum_i a_i * b_i as a single node
+ *
+ * @param a Array of n Values
+ * @param b Array of n Values
+ * @param n Length of both arrays
+ * @return Pointer to the new Value object
+ */
+Value *dot(Value **a, Value **b, int n) {
+  Value *res = make_node(OP_DOT, 2 * n);
+
+  for (int i = 0; i < n; i++) {
+    res->children[i] = a[i];
+    res->children[n + i] = b[i];
+  }
+  return finish_node(res, dot_forward, dot_reverse);
+}
+
+// node computing f(a) for a single-input op
+static Value *unary(Op op, Value *a, void (*forward)(Value *),
+                    void (*reverse)(Value *)) {
+  Value *res = make_node(op, 1);
+
+  res->children[0] = a;
+  return finish_node(res, forward, reverse);
+}
+
+/**
+  @brief e^a as a single node (named to stay clear of libm's exp)
+  @param (a: Value) Value object
+  @returns Pointer to the new Value object
+ */
+Value *expv(Value *a) { return unary(OP_EXP, a, exp_forward, exp_reverse); }
+
+/**
+  @brief natural log of a as a single node
+  @param (a: Value) Value object
+  @returns Pointer to the new Value object
+ */
+Value *logv(Value *a) { return unary(OP_LOG, a, log_forward, log_reverse); }
+
+/**
+  @brief tanh(a) as a single node
+  @param (a: Value) Value object
+  @returns Pointer to the new Value object
+ */
+Value *tanhv(Value *a) {
+  return unary(OP_TANH, a, tanh_forward, tanh_reverse);
+}
+
+/**
+  @brief 1 / (1 + e^-a) as a single node
+  @param (a: Value) Value object
+  @returns Pointer to the new Value object
+ */
+Value *sigmoid(Value *a) {
+  return unary(OP_SIGMOID, a, sigmoid_forward, sigmoid_reverse);
+}
+
+/**
+ * @brief Cross-entropy of softmax(logits) against a target distribution
+ *
+ * One node for -sum_i y_i log softmax(z)_i, computed through a max-shifted
+ * log-sum-exp. For a class label pass one-hot constValue targets.
+ *
+ * @param logits Array of n logits
+ * @param targets Array of n target probabilities
+ * @param n Number of classes
+ * @return Pointer to the new Value object
+ */
+Value *softmax_cross_entropy(Value **logits, Value **targets, int n) {
+  Value *res =
+      make_node_sized(sizeof(SoftmaxCEValue), OP_SOFTMAX_CE, 2 * n);
+
+  for (int i = 0; i < n; i++) {
+    res->children[i] = logits[i];
+    res->children[n + i] = targets[i];
+  }
+  return finish_node(res, softmax_ce_forward, softmax_ce_reverse);
+}
+
+/** ********** GRAPH OPTIMIZATION ********** **/
+
+// hash of a node's (op, children), or of a constant's value
+static size_t cse_hash(const Value *v) {
+  uint64_t h = 0xcbf29ce484222325ull ^ (uint64_t)v->op;
+  if (!v->n_children) {
+    union {
+      scalar_t x;
+      unsigned char b[sizeof(scalar_t)];
+    } d = {v->data};
+    for (size_t i = 0; i < sizeof(scalar_t); i++)
+      h = (h ^ d.b[i]) * 0x100000001b3ull;
+  }
+  for (int i = 0; i < v->n_children; i++)
+    h = (h ^ (uintptr_t)v->children[i]) * 0x100000001b3ull;
+  return (size_t)(h ^ (h >> 29));
+}
+
+// 1 if a and b compute the same thing from the same children
+static int cse_equal(const Value *a, const Value *b) {
+  if (a->op != b->op || a->n_children != b->n_children)
+    return 0;
+  if (!a->n_children)
+    return a->data == b->data;
+  for (int i = 0; i < a->n_children; i++)
+    if (a->children[i] != b->children[i])
+      return 0;
+  return 1;
+}
+
+/**
+ * @brief Folds constant subtrees and merges duplicate nodes below `root`
+ *
+ * One pass over the topological order, children first:
+ * - Every child pointer is redirected to its child's replacement, moving
+ *   the reference with it.
+ * - A node whose children are all constants already holds its value, so it
+ *   becomes a constant leaf and lets go of its children.
+ * - Otherwise the node (or constant) is looked up by (op, children) in a
+ *   hash table, with add / mul children put in address order first, and
+ *   replaced by an earlier identical node if there is one. Variable leaves
+ *   and OP_CUSTOM nodes are left alone.
+ * A final parents-first sweep frees the nodes nothing references anymore,
+ * so the whole rewrite is linear in the graph size. Nodes outside the graph
+ * keep their references and survive.
+ *
+ * @param root Pointer to the root Value object of the computational graph
+ * @return Number of nodes released, or -1 if out of memory
+ */
+int optimize_graph(Value *root) {
+  Topo topo;
+  topo_init(&topo);
+  int n = build_dag(root, &topo);
+  if (n < 0)
+    return -1;
+
+  size_t cap = 16;
+  while (cap < 2 * (size_t)n)
+    cap *= 2;
+  Value **table = (Value **)calloc(cap, sizeof(Value *));
+  Value **repl = (Value **)malloc(n * sizeof(Value *));
+  if (!table || !repl) {
+    free(table);
+    free(repl);
+    topo_free(&topo);
+    return -1;
+  }
+
+  Value **order = topo.order;
+  for (int i = 0; i < n; i++) {
+    order[i]->index = i;
+    repl[i] = order[i];
+  }
+
+  for (int i = 0; i < n; i++) {
+    Value *v = order[i];
+    if (v->op == OP_CUSTOM || (!v->n_children && !(v->flags & VALUE_CONST)))
+      continue;
+
+    int all_const = v->n_children > 0;
+    for (int j = 0; j < v->n_children; j++) {
+      Value *c = v->children[j];
+      Value *r = repl[c->index];
+      if (r != c) {
+        c->refs--;
+        r->refs++;
+        v->children[j] = r;
+      }
+      all_const &= (r->flags & VALUE_CONST) != 0;
+    }
+
+    if (all_const) {
+      for (int j = 0; j < v->n_children; j++)
+        v->children[j]->refs--;
+      v->n_children = 0;
+      v->op = OP_LEAF;
+      v->forward = NULL;
+      v->reverse = NULL;
+      v->tangent = 0;
+      v->flags = (v->flags | VALUE_CONST) & ~VALUE_REQUIRES_GRAD;
+    } else if ((v->op == OP_ADD || v->op == OP_MUL) &&
+               (uintptr_t)v->children[0] > (uintptr_t)v->children[1]) {
+      Value *t = v->children[0];
+      v->children[0] = v->children[1];
+      v->children[1] = t;
+    }
+
+    size_t slot = cse_hash(v) & (cap - 1);
+    while (table[slot] && !cse_equal(table[slot], v))
+      slot = (slot + 1) & (cap - 1);
+    if (table[slot])
+      repl[i] = table[slot];
+    else
+      table[slot] = v;
+  }
+
+  int released = 0;
+  for (int i = n - 1; i >= 0; i--) {
+    Value *v = order[i];
+    if (v != root && v->refs <= 0) {
+      free_node(v);
+      released++;
+    }
+  }
+
+  free(table);
+  free(repl);
+  topo_free(&topo);
+  return released;
+}
+
+/** ********** HIGHER-ORDER GRADIENTS ********** **/
+
+// 1 if the gradient should flow into v
+static int wants_grad(const Value *v) {
+  return (v->flags & VALUE_REQUIRES_GRAD) != 0;
+}
+
+// grads[c] += g, building an add node once c has a gradient already
+static void grad_node_acc(Value **grads, Value *c, Value *g) {
+  grads[c->index] = grads[c->index] ? add(grads[c->index], g) : g;
+}
+
+/**
+ * @brief Gradient nodes of a softmax_cross_entropy node's logits and targets
+ *
+ * Rebuilds the log-sum-exp from expv/logv so it is differentiable itself;
+ * the shift by the max is a constant, which leaves the result unchanged.
+ */
+static void grad_node_softmax_ce(Value **grads, Value *v, Value *g) {
+  int n = v->n_children / 2;
+  Value **z = v->children;
+  Value **y = v->children + n;
+  Value **e = (Value **)malloc(n * sizeof(Value *));
+  if (!e)
+    return;
+
+  scalar_t zmax = z[0]->data;
+  for (int i = 1; i < n; i++)
+    zmax = z[i]->data > zmax ? z[i]->data : zmax;
+  Value *m = constValue(zmax);
+  for (int i = 0; i < n; i++)
+    e[i] = expv(sub(z[i], m));
+  Value *lse = add(m, logv(sum(e, n)));
+
+  int want_z = 0;
+  for (int i = 0; i < n; i++)
+    want_z |= wants_grad(z[i]);
+  Value *total = want_z ? sum(y, n) : NULL;
+
+  for (int i = 0; i < n; i++) {
+    if (wants_grad(z[i]))
+      grad_node_acc(grads, z[i],
+                    mul(g, sub(mul(expv(sub(z[i], lse)), total), y[i])));
+    if (wants_grad(y[i]))
+      grad_node_acc(grads, y[i], mul(g, sub(lse, z[i])));
+  }
+  free(e);
+}
+
+/**
+ * @brief Builds the gradient nodes of v's children from v's gradient node g
+ *
+ * Mirrors the reverse functions. A contribution is only built for children
+ * that want a gradient, so no node is created just to be thrown away.
+ */
+static void grad_node_children(Value **grads, Value *v, Value *g) {
+  Value **ch = v->children;
+  int w0 = wants_grad(ch[0]);
+  int w1 = v->n_children > 1 && wants_grad(ch[1]);
+
+  switch (v->op) {
+  case OP_ADD:
+    if (w0)
+      grad_node_acc(grads, ch[0], g);
+    if (w1)
+      grad_node_acc(grads, ch[1], g);
+    break;
+  case OP_SUB:
+    if (w0)
+      grad_node_acc(grads, ch[0], g);
+    if (w1)
+      grad_node_acc(grads, ch[1], neg(g));
+    break;
+  case OP_NEG:
+    if (w0)
+      grad_node_acc(grads, ch[0], neg(g));
+    break;
+  case OP_MUL:
+    if (w0)
+      grad_node_acc(grads, ch[0], mul(g, ch[1]));
+    if (w1)
+      grad_node_acc(grads, ch[1], mul(g, ch[0]));
+    break;
+  case OP_DIV:
+    if (w0)
+      grad_node_acc(grads, ch[0], divide(g, ch[1]));
+    if (w1)
+      grad_node_acc(grads, ch[1],
+                    neg(divide(mul(g, ch[0]), mul(ch[1], ch[1]))));
+    break;
+  case OP_PWR:
+    if (w0)
+      grad_node_acc(
+          grads, ch[0],
+          mul(g, mul(ch[1], pwr(ch[0], sub(ch[1], constValue(1))))));
+    // like pwr_reverse, the exponent only gets a gradient for a positive base
+    if (w1 && ch[0]->data > 0)
+      grad_node_acc(grads, ch[1],
+                    mul(g, mul(logv(ch[0]), pwr(ch[0], ch[1]))));
+    break;
+  case OP_EXP:
+    if (w0)
+      grad_node_acc(grads, ch[0], mul(g, expv(ch[0])));
+    break;
+  case OP_LOG:
+    if (w0)
+      grad_node_acc(grads, ch[0], divide(g, ch[0]));
+    break;
+  case OP_TANH:
+    if (w0) {
+      Value *t = tanhv(ch[0]);
+      grad_node_acc(grads, ch[0], mul(g, sub(constValue(1), mul(t, t))));
+    }
+    break;
+  case OP_SIGMOID:
+    if (w0) {
+      Value *s = sigmoid(ch[0]);
+      grad_node_acc(grads, ch[0], mul(g, mul(s, sub(constValue(1), s))));
+    }
+    break;
+  case OP_SOFTMAX_CE:
+    grad_node_softmax_ce(grads, v, g);
+    break;
+  case OP_RELU:
+    if (w0 && ch[0]->data > 0)
+      grad_node_acc(grads, ch[0], g);
+    break;
+  case OP_MUL_ADD:
+    if (w0)
+      grad_node_acc(grads, ch[0], mul(g, ch[1]));
+    if (w1)
+      grad_node_acc(grads, ch[1], mul(g, ch[0]));
+    if (wants_grad(ch[2]))
+      grad_node_acc(grads, ch[2], g);
+    break;
+  case OP_LINEAR_RELU:
+    if (v->data <= 0)
+      break;
+    // fall through
+  case OP_LINEAR:
+  case OP_DOT: {
+    int n = v->op == OP_DOT ? v->n_children / 2 : (v->n_children - 1) / 2;
+    for (int i = 0; i < n; i++) {
+      if (wants_grad(ch[i]))
+        grad_node_acc(grads, ch[i], mul(g, ch[n + i]));
+      if (wants_grad(ch[n + i]))
+        grad_node_acc(grads, ch[n + i], mul(g, ch[i]));
+    }
+    if (v->op != OP_DOT && wants_grad(ch[2 * n]))
+      grad_node_acc(grads, ch[2 * n], g);
+    break;
+  }
+  case OP_SUM:
+  case OP_MEAN: {
+    Value *gi = v->op == OP_MEAN
+                    ? mul(g, constValue((scalar_t)1 / v->n_children))
+                    : g;
+    for (int i = 0; i < v->n_children; i++)
+      if (wants_grad(ch[i]))
+        grad_node_acc(grads, ch[i], gi);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+/**
+ * @brief Reverse pass that builds the gradients as graph nodes
+ *
+ * Walks the same pruned order as reverse, but every gradient contribution
+ * is built with the operators (mul(g, b) instead of grad += g * b), so the
+ * returned gradients are ordinary nodes that can be differentiated again.
+ * For example, reverse(dot(grads, v, n)) leaves the Hessian-vector product
+ * H v in the leaves' `grad`. relu gates are constant, so they just select
+ * which parents contribute. `grad` fields are not touched.
+ *
+ * The gradient nodes only reference strict descendants of root, and each
+ * returned gradient holds a reference. Release them with value_release,
+ * before or after free_graph on root; the counts keep shared nodes alive
+ * until their last user goes.
+ *
+ * @param root Node to differentiate
+ * @param wrt Nodes to differentiate with respect to
+ * @param n_wrt Number of nodes in wrt
+ * @param grads Receives d root / d wrt[k], retained; constValue(0) when
+ * wrt[k] does not influence root
+ * @return 0 on success, -1 if out of memory or the graph holds an OP_CUSTOM
+ * node
+ */
+int grad_graph(Value *root, Value **wrt, int n_wrt, Value **grads) {
+  Topo topo;
+  topo_init(&topo);
+  int n = build_grad_dag(root, &topo);
+  Value **g = n > 0 ? (Value **)calloc(n, sizeof(Value *)) : NULL;
+  if (!g) {
+    topo_free(&topo);
+    return -1;
+  }
+
+  Value **order = topo.order;
+  for (int i = 0; i < n; i++) {
+    Value *v = order[i];
+    v->index = i;
+    if (v->op == OP_CUSTOM) {
+      free(g);
+      topo_free(&topo);
+      return -1;
+    }
+  }
+
+  g[n - 1] = constValue(1);
+  for (int i = n - 1; i >= 0; i--)
+    if (g[i] && order[i]->n_children)
+      grad_node_children(g, order[i], g[i]);
+
+  for (int k = 0; k < n_wrt; k++) {
+    int i = wrt[k]->index;
+    int reached = i >= 0 && i < n && order[i] == wrt[k] && g[i];
+    grads[k] = value_retain(reached ? g[i] : constValue(0));
+  }
+
+  // drop the gradients of intermediates that nothing consumed (e.g. behind
+  // a closed relu gate). One node can sit in several slots, so every slot
+  // holds a reference while they are released one by one.
+  for (int i = 0; i < n; i++)
+    if (g[i])
+      value_retain(g[i]);
+  for (int i = 0; i < n; i++)
+    if (g[i])
+      value_release(g[i]);
+
+  free(g);
+  topo_free(&topo);
+  return 0;
+}
+
+/** ********** COMPILED GRAPHS ********** **/
+
+/**
+  @struct Graph
+  @brief  Graph whose topological order was captured once for replay
+  @param (root: Value) output node
+  @param (order: [Value]) nodes sorted so children come before parents
+  @param (size: int) number of nodes in order
+ */
+typedef struct Graph {
+  Value *root;
+  Value **order;
+  int size;
+} Graph;
+
+/**
+ * @brief Captures the topological order of a fixed-shape graph
+ *
+ * The graph can then be re-run with graph_forward and graph_backward after
+ * the leaves' `data` has been changed, without allocating nodes or sorting
+ * again.
+ *
+ * @param root Pointer to the root Value object of the computational graph
+ * @return Graph object, or NULL if out of memory
+ */
+Graph *compile(Value *root) {
+  Graph *g = (Graph *)malloc(sizeof(Graph));
+  if (!g)
+    return NULL;
+
+  Topo topo;
+  topo_init(&topo);
+  if (build_dag(root, &topo) < 0) {
+    topo_free(&topo);
+    free(g);
+    return NULL;
+  }
+
+  // keep the order buffer, drop the DFS stack
+  g->root = root;
+  g->order = topo.order;
+  g->size = topo.size;
+  free(topo.stack);
+
+  return g;
+}
+
+/**
+  @brief recompute `data` (and `tangent` in forward mode) of every non-leaf
+  node, children before parents
+  @param (g: Graph) compiled Graph
+ */
+void graph_forward(Graph *g) {
+  for (int i = 0; i < g->size; i++) {
+    Value *v = g->order[i];
+    if (v->forward)
+      v->forward(v);
+    if (forward_mode && v->n_children)
+      node_tangent(v);
+  }
+}
+
+/**
+ * @brief Runs the reverse pass over the captured order
+ *
+ * Gradients of every node, leaves included, are reset before the root is
+ * seeded, so each call yields the gradients of the current forward pass
+ * rather than accumulating across steps.
+ *
+ * @param g Pointer to the compiled Graph
+ */
+void graph_backward(Graph *g) {
+  Value **order = g->order;
+  for (int i = 0; i < g->size; i++)
+    order[i]->grad = 0;
+  g->root->grad = 1.0;
+
+  for (int i = g->size - 1; i >= 0; i--) {
+    if (order[i]->reverse && (order[i]->flags & VALUE_REQUIRES_GRAD))
+      REVERSE_NODE(order[i]);
+  }
+  clip_leaves(order, g->size);
+}
+
+/**
+  @brief free a compiled Graph; the nodes themselves are left untouched
+  @param (g: Graph) compiled Graph
+ */
+void graph_free(Graph *g) {
+  if (!g)
+    return;
+  free(g->order);
+  free(g);
+}
+
+/** ********** PARALLEL BACKWARD ********** **/
+
+/**
+  @struct WorkerPool
+  @brief  Persistent threads that run a backward pass level by level
+  @param (n_threads: int) workers including the calling thread
+  @param (threads: [pthread_t]) the n_threads - 1 helper threads
+  @param (start: pthread_barrier_t) releases helpers into a level
+  @param (done: pthread_barrier_t) joins everyone at the end of a level
+  @param (gate: pthread_mutex_t) held by pool_create until the barriers are
+  final, so new helpers cannot reach them earlier
+  @param (items: [Value]) nodes of the level being processed
+  @param (n_items: int) number of nodes in items
+  @param (next: int) next unclaimed position in items
+  @param (shutdown: int) tells helpers to exit
+  @param (topo: Topo) reused topological order
+  @param (level: [int]) level of every node, by topo position
+  @param (by_level: [Value]) nodes grouped by level
+  @param (level_start: [int]) level l is by_level[level_start[l] ..
+  level_start[l + 1])
+  @param (cap: int) capacity of level / by_level
+  @param (level_cap: int) capacity of level_start
+ */
+typedef struct WorkerPool {
+  int n_threads;
+  pthread_t *threads;
+  pthread_barrier_t start;
+  pthread_barrier_t done;
+  pthread_mutex_t gate;
+
+  Value **items;
+  int n_items;
+  int next;
+  int shutdown;
+
+  Topo topo;
+  int *level;
+  Value **by_level;
+  int *level_start;
+  int cap;
+  int level_cap;
+} WorkerPool;
+
+// claim chunks of the current level until none are left
+static void pool_run(WorkerPool *pool) {
+  for (;;) {
+    int i = __atomic_fetch_add(&pool->next, PARALLEL_CHUNK, __ATOMIC_RELAXED);
+    if (i >= pool->n_items)
+      return;
+
+    int end = i + PARALLEL_CHUNK < pool->n_items ? i + PARALLEL_CHUNK
+                                                 : pool->n_items;
+    for (; i < end; i++) {
+      Value *v = pool->items[i];
+      if (v->reverse)
+        REVERSE_NODE(v);
+    }
+  }
+}
+
+// helper thread: wait for a level, work on it, report back
+static void *pool_worker(void *arg) {
+  WorkerPool *pool = (WorkerPool *)arg;
+  parallel_backward = 1;
+  pthread_mutex_lock(&pool->gate);
+  pthread_mutex_unlock(&pool->gate);
+  for (;;) {
+    pthread_barrier_wait(&pool->start);
+    if (pool->shutdown)
+      return NULL;
+    pool_run(pool);
+    pthread_barrier_wait(&pool->done);
+  }
+}
+
+/**
+  @brief create a pool of worker threads for reverse_parallel
+  @param (n_threads: int) total threads, the caller included; values below 1
+  are treated as 1
+  @returns WorkerPool object, or NULL if threads could not be started
+ */
+WorkerPool *pool_create(int n_threads) {
+  WorkerPool *pool = (WorkerPool *)calloc(1, sizeof(WorkerPool));
+  if (!pool)
+    return NULL;
+
+  pool->n_threads = n_threads < 1 ? 1 : n_threads;
+  topo_init(&pool->topo);
+  pool->threads = (pthread_t *)malloc(pool->n_threads * sizeof(pthread_t));
+  if (!pool->threads) {
+    free(pool);
+    return NULL;
+  }
+  pthread_barrier_init(&pool->start, NULL, pool->n_threads);
+  pthread_barrier_init(&pool->done, NULL, pool->n_threads);
+  pthread_mutex_init(&pool->gate, NULL);
+
+  pthread_mutex_lock(&pool->gate);
+  for (int i = 1; i < pool->n_threads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, pool_worker, pool)) {
+      // run with the threads we managed to start; they are all still held
+      // at the gate, so no one is waiting on the barriers yet
+      pthread_barrier_destroy(&pool->start);
+      pthread_barrier_destroy(&pool->done);
+      pthread_barrier_init(&pool->start, NULL, i);
+      pthread_barrier_init(&pool->done, NULL, i);
+      pool->n_threads = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->gate);
+
+  return pool;
+}
+
+/**
+  @brief stop the worker threads and free the pool
+  @param (pool: WorkerPool) WorkerPool object
+ */
+void pool_destroy(WorkerPool *pool) {
+  if (!pool)
+    return;
+
+  if (pool->n_threads > 1) {
+    pool->shutdown = 1;
+    pthread_barrier_wait(&pool->start);
+    for (int i = 1; i < pool->n_threads; i++)
+      pthread_join(pool->threads[i], NULL);
+  }
+  pthread_barrier_destroy(&pool->start);
+  pthread_barrier_destroy(&pool->done);
+  pthread_mutex_destroy(&pool->gate);
+
+  topo_free(&pool->topo);
+  free(pool->level);
+  free(pool->by_level);
+  free(pool->level_start);
+  free(pool->threads);
+  free(pool);
+}
+
+/**
+ * @brief Groups the sorted nodes into levels by distance from the root
+ *
+ * A node's level is one more than the deepest of its parents, so all of a
+ * node's parents sit in earlier levels and have finished writing its
+ * gradient before its own reverse function runs.
+ *
+ * @param pool Pool whose topo holds the sorted graph
+ * @return Number of levels, or -1 if out of memory
+ */
+static int pool_levels(WorkerPool *pool) {
+  Value **order = pool->topo.order;
+  int n = pool->topo.size;
+
+  if (grow_buffer((void **)&pool->level, &pool->cap, n, sizeof(int)))
+    return -1;
+  int by_level_cap = pool->cap;
+  Value **by_level =
+      (Value **)realloc(pool->by_level, by_level_cap * sizeof(Value *));
+  if (!by_level)
+    return -1;
+  pool->by_level = by_level;
+
+  for (int i = 0; i < n; i++) {
+    order[i]->index = i;
+    pool->level[i] = 0;
+  }
+
+  int n_levels = 1;
+  for (int i = n - 1; i >= 0; i--) {
+    Value *v = order[i];
+    int l = pool->level[i] + 1;
+    for (int j = 0; j < v->n_children; j++) {
+      if (!(v->children[j]->flags & VALUE_REQUIRES_GRAD))
+        continue;
+      int c = v->children[j]->index;
+      if (pool->level[c] < l)
+        pool->level[c] = l;
+    }
+    if (pool->level[i] >= n_levels)
+      n_levels = pool->level[i] + 1;
+  }
+
+  // counting sort by level: count into level_start[l + 1], turn the counts
+  // into bucket ends, fill each bucket from its end down, then shift the
+  // resulting bucket starts into place
+  if (grow_buffer((void **)&pool->level_start, &pool->level_cap, n_levels + 1,
+                  sizeof(int)))
+    return -1;
+  for (int l = 0; l <= n_levels; l++)
+    pool->level_start[l] = 0;
+  for (int i = 0; i < n; i++)
+    pool->level_start[pool->level[i] + 1]++;
+  for (int l = 0; l < n_levels; l++)
+    pool->level_start[l + 1] += pool->level_start[l];
+  for (int i = n - 1; i >= 0; i--)
+    pool->by_level[--pool->level_start[pool->level[i] + 1]] = order[i];
+  for (int l = 0; l < n_levels; l++)
+    pool->level_start[l] = pool->level_start[l + 1];
+  pool->level_start[n_levels] = n;
+
+  return n_levels;
+}
+
+/**
+ * @brief Performs the reverse pass with the pool's threads
+ *
+ * Nodes are processed one level at a time; within a level they are independent,
+ * so workers claim them in chunks of PARALLEL_CHUNK from a shared counter,
+ * which balances uneven levels dynamically. Shared children are updated with
+ * atomic adds through grad_acc. Small levels run on the calling thread to
+ * avoid paying for a barrier. A graph holding an OP_CUSTOM node (e.g. a
+ * checkpoint, whose replay uses the caller's thread modes and its scratch
+ * arena) runs entirely on the calling thread.
+ *
+ * @param root Pointer to the root Value object of the computational graph
+ * @param pool WorkerPool from pool_create
+ */
+void reverse_parallel(Value *root, WorkerPool *pool) {
+  if (build_grad_dag(root, &pool->topo) < 0)
+    return;
+  int n_levels = pool_levels(pool);
+  if (n_levels < 0)
+    return;
+
+  int serial = pool->n_threads == 1;
+  for (int i = 0; i < pool->topo.size && !serial; i++)
+    serial = pool->topo.order[i]->op == OP_CUSTOM;
+
+  root->grad = 1.0;
+  parallel_backward = !serial;
+
+  for (int l = 0; l < n_levels; l++) {
+    Value **items = pool->by_level + pool->level_start[l];
+    int n_items = pool->level_start[l + 1] - pool->level_start[l];
+
+    if (serial || n_items < PARALLEL_MIN_LEVEL) {
+      for (int i = 0; i < n_items; i++)
+        if (items[i]->reverse)
+          REVERSE_NODE(items[i]);
+      continue;
+    }
+
+    pool->items = items;
+    pool->n_items = n_items;
+    pool->next = 0;
+    pthread_barrier_wait(&pool->start);
+    pool_run(pool);
+    pthread_barrier_wait(&pool->done);
+  }
+
+  parallel_backward = 0;
+  clip_leaves(pool->topo.order, pool->topo.size);
+}
+
+/** ********** CHECKPOINTING ********** **/
+
+/**
+  @brief builds a segment of the graph from `inputs`; must be deterministic
+  so it can be replayed during the backward pass
+ */
+typedef Value *(*SegmentFn)(Value **inputs, int n_inputs, void *ctx);
+
+/**
+  @struct CheckpointValue
+  @brief  Node standing in for a whole segment that is rebuilt on demand
+  @param (node: Value) the node itself; children are the segment inputs
+  @param (fn: SegmentFn) rebuilds the segment
+  @param (ctx: void) passed through to fn
+  @param (scratch: Arena) holds the segment while it is alive
+ */
+typedef struct CheckpointValue {
+  Value node;
+  SegmentFn fn;
+  void *ctx;
+  Arena *scratch;
+} CheckpointValue;
+
+// thread modes saved around a segment replay
+typedef struct SegmentModes {
+  Arena *arena;
+  struct SoAGraph *tape;
+  int forward;
+  int no_grad;
+} SegmentModes;
+
+// build into the scratch arena and keep the segment off any active tape
+static SegmentModes segment_enter(CheckpointValue *cp) {
+  SegmentModes m = {set_arena(cp->scratch), active_tape, forward_mode,
+                    no_grad};
+  active_tape = NULL;
+  return m;
+}
+
+// give back the references the segment's nodes took: scratch children go
+// away with the arena, but ctx parameters outlive it
+static void segment_release(CheckpointValue *cp, Topo *topo) {
+  for (int i = 0; i < topo->size; i++) {
+    Value *v = topo->order[i];
+    if (arena_owns(cp->scratch, v))
+      for (int j = 0; j < v->n_children; j++)
+        v->children[j]->refs--;
+  }
+}
+
+static void segment_leave(CheckpointValue *cp, SegmentModes m) {
+  arena_reset(cp->scratch);
+  set_arena(m.arena);
+  active_tape = m.tape;
+  forward_mode = m.forward;
+  no_grad = m.no_grad;
+}
+
+// rebuild the segment in the scratch arena from detached copies of the
+// inputs; NULL if out of memory
+static Value *checkpoint_replay(CheckpointValue *cp, Value ***copies) {
+  Value *c = &cp->node;
+  Value **in = (Value **)arena_alloc(cp->scratch,
+                                     (c->n_children + 1) * sizeof(Value *));
+  if (!in)
+    return NULL;
+  for (int i = 0; i < c->n_children; i++) {
+    in[i] = defaultValue(c->children[i]->data);
+    in[i]->tangent = c->children[i]->tangent;
+  }
+
+  *copies = in;
+  return cp->fn(in, c->n_children, cp->ctx);
+}
+
+/**
+  @brief runs the segment and keeps only its output (and, in forward mode,
+  the output's tangent); everything the segment allocated is released
+  straight away. The value is NaN if the segment could not be allocated
+  @param (c : Value) CheckpointValue node
+ */
+void checkpoint_forward(Value *c) {
+  CheckpointValue *cp = (CheckpointValue *)c;
+  SegmentModes m = segment_enter(cp);
+
+  Value **copies;
+  Value *out = checkpoint_replay(cp, &copies);
+  c->data = out ? out->data : NAN;
+  if (forward_mode)
+    c->tangent = out ? out->tangent : NAN;
+
+  Topo topo;
+  topo_init(&topo);
+  if (out && build_dag(out, &topo) >= 0)
+    segment_release(cp, &topo);
+  topo_free(&topo);
+
+  segment_leave(cp, m);
+}
+
+/**
+ * @brief Rebuilds the segment and backpropagates through it
+ *
+ * The segment is replayed from the inputs' current data, seeded with this
+ * node's gradient, and the gradients that reach the input copies are added
+ * to the real inputs. The segment is then released again, so at most one
+ * segment is alive at a time. Like the forward replay, the rebuilt segment
+ * is never recorded on the active tape.
+ *
+ * @param c Pointer to the CheckpointValue node
+ */
+void checkpoint_reverse(Value *c) {
+  CheckpointValue *cp = (CheckpointValue *)c;
+  SegmentModes m = segment_enter(cp);
+  forward_mode = 0;
+  no_grad = 0;
+
+  Value **copies;
+  Value *out = checkpoint_replay(cp, &copies);
+
+  Topo topo;
+  topo_init(&topo);
+  if (out && build_dag(out, &topo) >= 0) {
+    out->grad = c->grad;
+    for (int i = topo.size - 1; i >= 0; i--)
+      if (topo.order[i]->reverse)
+        REVERSE_NODE(topo.order[i]);
+
+    for (int i = 0; i < c->n_children; i++)
+      grad_acc(c->children[i], copies[i]->grad);
+    segment_release(cp, &topo);
+  }
+  topo_free(&topo);
+
+  segment_leave(cp, m);
+}
+
+/**
+ * @brief Runs a segment behind a checkpoint boundary
+ *
+ * The returned node has the same value as fn(inputs) but only the inputs
+ * are kept alive: the segment's intermediates are built in `scratch` and
+ * dropped after the forward pass, then rebuilt from the inputs when the
+ * backward pass reaches this node. This trades one extra forward of the
+ * segment for memory that no longer grows with its length.
+ *
+ * `scratch` is reset on every use, so it must be private to checkpoints and
+ * never the arena the outer graph lives in. Values fn reaches through ctx
+ * (e.g. parameters) must be leaves; they receive gradient directly, so the
+ * node always requires grad even when none of its inputs do. The function
+ * pointers make this an OP_CUSTOM node, so it is not supported by the
+ * index-based graph forms, and reverse_parallel runs a graph holding one on
+ * the calling thread only.
+ *
+ * @param fn Builds the segment from its inputs
+ * @param inputs Array of n_inputs segment inputs
+ * @param n_inputs Number of inputs
+ * @param ctx User pointer passed to fn
+ * @param scratch Arena for the segment's intermediates
+ * @return Pointer to the new Value object
+ */
+Value *checkpoint(SegmentFn fn, Value **inputs, int n_inputs, void *ctx,
+                  Arena *scratch) {
+  Value *res = make_node_sized(sizeof(CheckpointValue), OP_CUSTOM, n_inputs);
+  CheckpointValue *cp = (CheckpointValue *)res;
+
+  cp->fn = fn;
+  cp->ctx = ctx;
+  cp->scratch = scratch;
+  for (int i = 0; i < n_inputs; i++)
+    res->children[i] = inputs[i];
+  // parameters reached through ctx are invisible to the flag inheritance
+  res->flags |= VALUE_REQUIRES_GRAD;
+
+  return finish_node(res, checkpoint_forward, checkpoint_reverse);
+}
+
+/** ********** STRUCTURE OF ARRAYS ********** **/
+
+/**
+  @struct SoAGraph
+  @brief  Index-based copy of a graph with one contiguous array per field
+  @param (n: int) number of nodes, children before parents
+  @param (root: int) index of the output node
+  @param (batch: int) lanes per node; node i owns data[i * batch ..
+  (i + 1) * batch), one lane per minibatch sample
+  @param (data: [scalar_t]) lanes of every node
+  @param (grad: [grad_t]) gradient lanes of every node
+  @param (op: [unsigned char]) Op of every node
+  @param (child_start: [int]) node i's children are
+  child_idx[child_start[i] .. child_start[i + 1])
+  @param (child_idx: [int]) child indices, n_edges in total
+  @param (nodes: [Value]) Value each index was built from
+  @param (cap: int) node capacity of the arrays (tapes grow it as they record)
+  @param (edge_cap: int) capacity of child_idx
+  @param (map: void) file mapping the arrays point into (soa_map), or NULL
+  @param (map_size: size_t) length of the mapping
+  @param (invalid: int) set when a tape missed a record or met an OP_CUSTOM
+  node; tape_reverse refuses it until tape_clear
+ */
+typedef struct SoAGraph {
+  int n;
+  int root;
+  int batch;
+
+  scalar_t *data;
+  grad_t *grad;
+  unsigned char *op;
+  int *child_start;
+  int *child_idx;
+
+  Value **nodes;
+  int cap;
+  int edge_cap;
+
+  void *map;
+  size_t map_size;
+
+  int invalid;
+} SoAGraph;
+
+// 1 if p points into g's file mapping rather than the heap
+static int soa_mapped(const SoAGraph *g, const void *p) {
+  const unsigned char *base = (const unsigned char *)g->map;
+  return base && (const unsigned char *)p >= base &&
+         (const unsigned char *)p < base + g->map_size;
+}
+
+// free one of g's arrays unless it lives in the file mapping
+static void soa_release(const SoAGraph *g, void *p) {
+  if (!soa_mapped(g, p))
+    free(p);
+}
+
+/**
+  @brief free a SoAGraph; the source Values are left untouched
+  @param (g: SoAGraph) SoAGraph object
+ */
+void soa_free(SoAGraph *g) {
+  if (!g)
+    return;
+  soa_release(g, g->data);
+  soa_release(g, g->grad);
+  soa_release(g, g->op);
+  soa_release(g, g->child_start);
+  soa_release(g, g->child_idx);
+  free(g->nodes);
+  if (g->map)
+    munmap(g->map, g->map_size);
+  free(g);
+}
+
+/**
+ * @brief Flattens the graph below `root` into structure-of-arrays form
+ *
+ * Nodes are numbered in topological order and each Value's `index` is set
+ * to its position, so children always have smaller indices than their
+ * parents. Leaf data is copied in; refresh it later with soa_load.
+ *
+ * @param root Pointer to the root Value object of the computational graph
+ * @return SoAGraph object, or NULL if out of memory or the graph contains an
+ * OP_CUSTOM node
+ */
+SoAGraph *soa_compile(Value *root) {
+  Topo topo;
+  topo_init(&topo);
+  if (build_dag(root, &topo) < 0) {
+    topo_free(&topo);
+    return NULL;
+  }
+
+  int n = topo.size;
+  int n_edges = 0;
+  for (int i = 0; i < n; i++) {
+    if (topo.order[i]->op == OP_CUSTOM) {
+      topo_free(&topo);
+      return NULL;
+    }
+    topo.order[i]->index = i;
+    n_edges += topo.order[i]->n_children;
+  }
+
+  SoAGraph *g = (SoAGraph *)calloc(1, sizeof(SoAGraph));
+  if (!g) {
+    topo_free(&topo);
+    return NULL;
+  }
+  g->n = n;
+  g->root = root->index;
+  g->batch = 1;
+  g->data = (scalar_t *)malloc(n * sizeof(scalar_t));
+  g->grad = (grad_t *)calloc(n, sizeof(grad_t));
+  g->op = (unsigned char *)malloc(n);
+  g->child_start = (int *)malloc((n + 1) * sizeof(int));
+  g->child_idx = (int *)malloc((n_edges ? n_edges : 1) * sizeof(int));
+  g->nodes = topo.order;
+  g->cap = n;
+  g->edge_cap = n_edges ? n_edges : 1;
+  free(topo.stack);
+
+  if (!g->data || !g->grad || !g->op || !g->child_start || !g->child_idx) {
+    soa_free(g);
+    return NULL;
+  }
+
+  int e = 0;
+  for (int i = 0; i < n; i++) {
+    Value *v = g->nodes[i];
+    g->data[i] = v->data;
+    g->op[i] = (unsigned char)v->op;
+    g->child_start[i] = e;
+    for (int j = 0; j < v->n_children; j++)
+      g->child_idx[e++] = v->children[j]->index;
+  }
+  g->child_start[n] = e;
+
+  return g;
+}
+
+/**
+ * @brief Resizes every node to `batch` lanes
+ *
+ * Lane contents are reset: each lane gets a copy of the node's current first
+ * lane and gradients are zeroed. Fill per-sample inputs afterwards through
+ * soa_lanes.
+ *
+ * @param g Pointer to the SoAGraph
+ * @param batch Number of lanes (minibatch size), at least 1
+ * @return 0 on success, -1 if out of memory
+ */
+int soa_set_batch(SoAGraph *g, int batch) {
+  size_t lanes = (size_t)g->n * batch;
+  scalar_t *data = (scalar_t *)malloc(lanes * sizeof(scalar_t));
+  grad_t *grad = (grad_t *)calloc(lanes, sizeof(grad_t));
+  if (batch < 1 || !data || !grad) {
+    free(data);
+    free(grad);
+    return -1;
+  }
+
+  for (int i = 0; i < g->n; i++)
+    for (int l = 0; l < batch; l++)
+      data[(size_t)i * batch + l] = g->data[(size_t)i * g->batch];
+
+  soa_release(g, g->data);
+  soa_release(g, g->grad);
+  g->data = data;
+  g->grad = grad;
+  g->batch = batch;
+  return 0;
+}
+
+/**
+  @brief lanes of a node, e.g. to write one input sample per lane
+  @param (g: SoAGraph) SoAGraph object
+  @param (v: Value) Value the graph was compiled from
+  @returns pointer to `batch` consecutive values
+ */
+scalar_t *soa_lanes(SoAGraph *g, Value *v) {
+  return g->data + (size_t)v->index * g->batch;
+}
+
+/**
+  @brief gradient lanes of a node
+  @param (g: SoAGraph) SoAGraph object
+  @param (v: Value) Value the graph was compiled from
+  @returns pointer to `batch` consecutive gradients
+ */
+grad_t *soa_grad_lanes(SoAGraph *g, Value *v) {
+  return g->grad + (size_t)v->index * g->batch;
+}
+
+/**
+  @brief copy the current `data` of the source leaves into every lane; no-op
+  for graphs loaded with soa_map
+  @param (g: SoAGraph) SoAGraph object
+ */
+void soa_load(SoAGraph *g) {
+  if (!g->nodes)
+    return;
+  int B = g->batch;
+  for (int i = 0; i < g->n; i++)
+    if (g->op[i] == OP_LEAF)
+      for (int l = 0; l < B; l++)
+        g->data[(size_t)i * B + l] = g->nodes[i]->data;
+}
+
+/**
+ * @brief Copies results back into the source Values
+ *
+ * `data` receives the first lane and `grad` the sum over all lanes, which is
+ * the minibatch gradient of shared leaves such as weights. Graphs loaded with
+ * soa_map have no source Values and are left alone.
+ *
+ * @param g Pointer to the SoAGraph
+ */
+void soa_store(SoAGraph *g) {
+  if (!g->nodes)
+    return;
+  int B = g->batch;
+  for (int i = 0; i < g->n; i++) {
+    const grad_t *grad = g->grad + (size_t)i * B;
+    grad_t sum = 0;
+    for (int l = 0; l < B; l++)
+      sum += grad[l];
+    g->nodes[i]->data = g->data[(size_t)i * B];
+    g->nodes[i]->grad = sum;
+  }
+}
+
+// log-sum-exp of one lane of the n nodes in idx; lane points at data + l
+static scalar_t soa_lse(const scalar_t *lane, const int *idx, int n, int B) {
+  scalar_t m = lane[(size_t)idx[0] * B];
+  for (int j = 1; j < n; j++)
+    m = lane[(size_t)idx[j] * B] > m ? lane[(size_t)idx[j] * B] : m;
+  scalar_t s = 0;
+  for (int j = 0; j < n; j++)
+    s += EXP(lane[(size_t)idx[j] * B] - m);
+  return m + LOG(s);
+}
+
+/**
+ * @brief Recomputes every non-leaf node in index order
+ *
+ * Each case is a loop over the node's lanes, so the whole minibatch goes
+ * through one traversal of the graph and the loops vectorize.
+ *
+ * @param g Pointer to the SoAGraph
+ */
+void soa_forward(SoAGraph *g) {
+  int B = g->batch;
+
+  for (int i = 0; i < g->n; i++) {
+    const int *ch = g->child_idx + g->child_start[i];
+    int n_ch = g->child_start[i + 1] - g->child_start[i];
+    scalar_t *c = g->data + (size_t)i * B;
+    const scalar_t *a = n_ch > 0 ? g->data + (size_t)ch[0] * B : NULL;
+    const scalar_t *b = n_ch > 1 ? g->data + (size_t)ch[1] * B : NULL;
+
+    switch (g->op[i]) {
+    case OP_ADD:
+      for (int l = 0; l < B; l++)
+        c[l] = a[l] + b[l];
+      break;
+    case OP_MUL:
+      for (int l = 0; l < B; l++)
+        c[l] = a[l] * b[l];
+      break;
+    case OP_PWR:
+      for (int l = 0; l < B; l++)
+        c[l] = POW(a[l], b[l]);
+      break;
+    case OP_RELU:
+      for (int l = 0; l < B; l++)
+        c[l] = a[l] > 0 ? a[l] : 0;
+      break;
+    case OP_EXP:
+      for (int l = 0; l < B; l++)
+        c[l] = EXP(a[l]);
+      break;
+    case OP_LOG:
+      for (int l = 0; l < B; l++)
+        c[l] = LOG(a[l]);
+      break;
+    case OP_TANH:
+      for (int l = 0; l < B; l++)
+        c[l] = TANH(a[l]);
+      break;
+    case OP_SIGMOID:
+      for (int l = 0; l < B; l++)
+        c[l] = 1 / (1 + EXP(-a[l]));
+      break;
+    case OP_SOFTMAX_CE: {
+      int n = n_ch / 2;
+      for (int l = 0; l < B; l++) {
+        scalar_t lse = soa_lse(g->data + l, ch, n, B), loss = 0;
+        for (int j = 0; j < n; j++)
+          loss += g->data[(size_t)ch[n + j] * B + l] *
+                  (lse - g->data[(size_t)ch[j] * B + l]);
+        c[l] = loss;
+      }
+      break;
+    }
+    case OP_NEG:
+      for (int l = 0; l < B; l++)
+        c[l] = -a[l];
+      break;
+    case OP_SUB:
+      for (int l = 0; l < B; l++)
+        c[l] = a[l] - b[l];
+      break;
+    case OP_DIV:
+      for (int l = 0; l < B; l++)
+        c[l] = a[l] / b[l];
+      break;
+    case OP_MUL_ADD: {
+      const scalar_t *d = g->data + (size_t)ch[2] * B;
+      for (int l = 0; l < B; l++)
+        c[l] = a[l] * b[l] + d[l];
+      break;
+    }
+    case OP_LINEAR:
+    case OP_LINEAR_RELU: {
+      int n = (n_ch - 1) / 2;
+      const scalar_t *bias = g->data + (size_t)ch[2 * n] * B;
+      for (int l = 0; l < B; l++)
+        c[l] = bias[l];
+      for (int j = 0; j < n; j++) {
+        const scalar_t *w = g->data + (size_t)ch[j] * B;
+        const scalar_t *x = g->data + (size_t)ch[n + j] * B;
+        for (int l = 0; l < B; l++)
+          c[l] += w[l] * x[l];
+      }
+      if (g->op[i] == OP_LINEAR_RELU)
+        for (int l = 0; l < B; l++)
+          c[l] = c[l] > 0 ? c[l] : 0;
+      break;
+    }
+    case OP_SUM:
+    case OP_MEAN:
+      for (int l = 0; l < B; l++)
+        c[l] = a[l];
+      for (int j = 1; j < n_ch; j++) {
+        const scalar_t *x = g->data + (size_t)ch[j] * B;
+        for (int l = 0; l < B; l++)
+          c[l] += x[l];
+      }
+      if (g->op[i] == OP_MEAN)
+        for (int l = 0; l < B; l++)
+          c[l] /= n_ch;
+      break;
+    case OP_DOT: {
+      int n = n_ch / 2;
+      for (int l = 0; l < B; l++)
+        c[l] = 0;
+      for (int j = 0; j < n; j++) {
+        const scalar_t *x = g->data + (size_t)ch[j] * B;
+        const scalar_t *y = g->data + (size_t)ch[n + j] * B;
+        for (int l = 0; l < B; l++)
+          c[l] += x[l] * y[l];
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+}
+
+// g[l] += sign * gc[l] * x[l]; x == NULL means a factor of 1
+static void soa_acc(grad_t *g, const grad_t *gc, const scalar_t *x,
+                    grad_t sign, int B) {
+  if (x) {
+    for (int l = 0; l < B; l++)
+      g[l] += sign * gc[l] * x[l];
+  } else {
+    for (int l = 0; l < B; l++)
+      g[l] += sign * gc[l];
+  }
+}
+
+// rescale a leaf's lanes so they add up to `c` instead of `sum`
+static void lanes_set_sum(grad_t *lanes, int B, grad_t sum, grad_t c) {
+  if (sum != 0)
+    scale_buffer(lanes, B, c / sum);
+  else
+    lanes[0] += c;
+}
+
+/**
+ * @brief Applies the clipping configuration to the leaf lanes of a SoAGraph
+ *
+ * Clipping acts on the minibatch gradient soa_store will write, i.e. each
+ * leaf's sum over its lanes, not on the per-sample fragments: the lanes are
+ * reduced first, the range or global norm is applied once to the sums, and
+ * the lanes are then rescaled to add up to the clipped value, so
+ * soa_grad_lanes keeps each sample's share. With batch 1 this is plain
+ * clipping.
+ *
+ * @param g Pointer to the SoAGraph
+ */
+static void soa_clip(SoAGraph *g) {
+  GradClip clip = grad_clip_config;
+  int B = g->batch;
+  if (clip.mode == CLIP_NONE)
+    return;
+
+  grad_t sq = 0;
+  for (int i = 0; i < g->n; i++) {
+    if (g->op[i] != OP_LEAF)
+      continue;
+    grad_t *lanes = g->grad + (size_t)i * B;
+    grad_t sum = 0;
+    for (int l = 0; l < B; l++)
+      sum += lanes[l];
+
+    if (clip.mode == CLIP_RANGE) {
+      grad_t c = sum < clip.min ? clip.min : sum;
+      c = c > clip.max ? clip.max : c;
+      if (c != sum)
+        lanes_set_sum(lanes, B, sum, c);
+    } else {
+      sq += sum * sum;
+    }
+  }
+
+  if (clip.mode == CLIP_NORM) {
+    grad_t norm = SQRT(sq);
+    if (norm > clip.max_norm)
+      for (int i = 0; i < g->n; i++)
+        if (g->op[i] == OP_LEAF)
+          scale_buffer(g->grad + (size_t)i * B, B, clip.max_norm / norm);
+  }
+}
+
+/**
+ * @brief Runs the reverse pass as one switch-dispatched loop over indices
+ *
+ * Computes the same gradients as reverse, clipping included, but reads data
+ * and grad from two contiguous arrays instead of chasing pointers into
+ * scattered nodes, and handles all lanes of a node at once. Gradients are
+ * reset first, so each call reflects only the current forward pass.
+ *
+ * @param g Pointer to the SoAGraph
+ */
+void soa_backward(SoAGraph *g) {
+  int B = g->batch;
+  const scalar_t *data = g->data;
+  grad_t *grad = g->grad;
+
+  for (size_t i = 0; i < (size_t)g->n * B; i++)
+    grad[i] = 0;
+  for (int l = 0; l < B; l++)
+    grad[(size_t)g->root * B + l] = 1.0;
+
+  for (int i = g->n - 1; i >= 0; i--) {
+    const int *ch = g->child_idx + g->child_start[i];
+    int n_ch = g->child_start[i + 1] - g->child_start[i];
+    if (n_ch == 0)
+      continue;
+
+    const scalar_t *c = data + (size_t)i * B;
+    const grad_t *gc = grad + (size_t)i * B;
+    const scalar_t *a = data + (size_t)ch[0] * B;
+    const scalar_t *b = n_ch > 1 ? data + (size_t)ch[1] * B : NULL;
+    grad_t *ga = grad + (size_t)ch[0] * B;
+    grad_t *gb = n_ch > 1 ? grad + (size_t)ch[1] * B : NULL;
+
+    switch (g->op[i]) {
+    case OP_ADD:
+      soa_acc(ga, gc, NULL, 1, B);
+      soa_acc(gb, gc, NULL, 1, B);
+      break;
+    case OP_MUL:
+      soa_acc(ga, gc, b, 1, B);
+      soa_acc(gb, gc, a, 1, B);
+      break;
+    case OP_PWR:
+      for (int l = 0; l < B; l++)
+        ga[l] += b[l] * POW(a[l], b[l] - 1) * gc[l];
+      for (int l = 0; l < B; l++)
+        if (a[l] > 0)
+          gb[l] += LOG(a[l]) * c[l] * gc[l];
+      break;
+    case OP_RELU:
+      for (int l = 0; l < B; l++)
+        ga[l] += a[l] > 0 ? gc[l] : 0;
+      break;
+    case OP_EXP:
+      soa_acc(ga, gc, c, 1, B);
+      break;
+    case OP_LOG:
+      for (int l = 0; l < B; l++)
+        ga[l] += gc[l] / a[l];
+      break;
+    case OP_TANH:
+      for (int l = 0; l < B; l++)
+        ga[l] += gc[l] * (1 - c[l] * c[l]);
+      break;
+    case OP_SIGMOID:
+      for (int l = 0; l < B; l++)
+        ga[l] += gc[l] * c[l] * (1 - c[l]);
+      break;
+    case OP_SOFTMAX_CE: {
+      int n = n_ch / 2;
+      for (int l = 0; l < B; l++) {
+        scalar_t lse = soa_lse(data + l, ch, n, B), total = 0;
+        for (int j = 0; j < n; j++)
+          total += data[(size_t)ch[n + j] * B + l];
+        for (int j = 0; j < n; j++) {
+          scalar_t z = data[(size_t)ch[j] * B + l];
+          scalar_t y = data[(size_t)ch[n + j] * B + l];
+          grad[(size_t)ch[j] * B + l] += gc[l] * (EXP(z - lse) * total - y);
+          grad[(size_t)ch[n + j] * B + l] += gc[l] * (lse - z);
+        }
+      }
+      break;
+    }
+    case OP_NEG:
+      soa_acc(ga, gc, NULL, -1, B);
+      break;
+    case OP_SUB:
+      soa_acc(ga, gc, NULL, 1, B);
+      soa_acc(gb, gc, NULL, -1, B);
+      break;
+    case OP_DIV:
+      for (int l = 0; l < B; l++)
+        ga[l] += gc[l] / b[l];
+      for (int l = 0; l < B; l++)
+        gb[l] -= gc[l] * c[l] / b[l];
+      break;
+    case OP_MUL_ADD:
+      soa_acc(ga, gc, b, 1, B);
+      soa_acc(gb, gc, a, 1, B);
+      soa_acc(grad + (size_t)ch[2] * B, gc, NULL, 1, B);
+      break;
+    case OP_LINEAR_RELU: {
+      int n = (n_ch - 1) / 2;
+      for (int j = 0; j < n; j++) {
+        const scalar_t *w = data + (size_t)ch[j] * B;
+        const scalar_t *x = data + (size_t)ch[n + j] * B;
+        grad_t *gw = grad + (size_t)ch[j] * B;
+        grad_t *gx = grad + (size_t)ch[n + j] * B;
+        for (int l = 0; l < B; l++)
+          gw[l] += c[l] > 0 ? gc[l] * x[l] : 0;
+        for (int l = 0; l < B; l++)
+          gx[l] += c[l] > 0 ? gc[l] * w[l] : 0;
+      }
+      grad_t *gbias = grad + (size_t)ch[2 * n] * B;
+      for (int l = 0; l < B; l++)
+        gbias[l] += c[l] > 0 ? gc[l] : 0;
+      break;
+    }
+    case OP_LINEAR: {
+      int n = (n_ch - 1) / 2;
+      for (int j = 0; j < n; j++) {
+        soa_acc(grad + (size_t)ch[j] * B, gc, data + (size_t)ch[n + j] * B, 1,
+                B);
+        soa_acc(grad + (size_t)ch[n + j] * B, gc, data + (size_t)ch[j] * B, 1,
+                B);
+      }
+      soa_acc(grad + (size_t)ch[2 * n] * B, gc, NULL, 1, B);
+      break;
+    }
+    case OP_SUM:
+    case OP_MEAN: {
+      grad_t scale = g->op[i] == OP_MEAN ? (grad_t)1 / n_ch : 1;
+      for (int j = 0; j < n_ch; j++)
+        soa_acc(grad + (size_t)ch[j] * B, gc, NULL, scale, B);
+      break;
+    }
+    case OP_DOT: {
+      int n = n_ch / 2;
+      for (int j = 0; j < n; j++) {
+        soa_acc(grad + (size_t)ch[j] * B, gc, data + (size_t)ch[n + j] * B, 1,
+                B);
+        soa_acc(grad + (size_t)ch[n + j] * B, gc, data + (size_t)ch[j] * B, 1,
+                B);
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  soa_clip(g);
+}
+
+/** ********** TAPE ********** **/
+
+/**
+  @brief create an empty tape; a tape is a SoAGraph that operators append to
+  while it is active, in the order they run
+  @returns SoAGraph object, or NULL if out of memory
+ */
+SoAGraph *tape_create(void) {
+  SoAGraph *t = (SoAGraph *)calloc(1, sizeof(SoAGraph));
+  if (!t)
+    return NULL;
+
+  t->batch = 1;
+  t->root = -1;
+  t->child_start = (int *)malloc(sizeof(int));
+  if (!t->child_start) {
+    free(t);
+    return NULL;
+  }
+  t->child_start[0] = 0;
+  return t;
+}
+
+/**
+  @brief forget every record but keep the buffers for the next step
+  @param (t: SoAGraph) tape
+ */
+void tape_clear(SoAGraph *t) {
+  t->n = 0;
+  t->root = -1;
+  t->child_start[0] = 0;
+  t->invalid = 0;
+}
+
+/**
+  @brief make operators on this thread record into `t`; pass NULL to stop
+  @param (t: SoAGraph) tape with batch 1, or NULL
+  @returns the previously active tape
+ */
+SoAGraph *tape_begin(SoAGraph *t) {
+  SoAGraph *prev = active_tape;
+  active_tape = t;
+  return prev;
+}
+
+/**
+  @brief stop recording on this thread
+ */
+void tape_end(void) { active_tape = NULL; }
+
+// make room for `nodes` more records with `edges` more child indices
+static int tape_reserve(SoAGraph *t, int nodes, int edges) {
+  if (t->n + nodes > t->cap) {
+    int cap = t->cap ? t->cap : TOPO_INIT_CAP;
+    while (cap < t->n + nodes)
+      cap *= 2;
+
+    scalar_t *data = (scalar_t *)realloc(t->data, cap * sizeof(scalar_t));
+    if (data)
+      t->data = data;
+    grad_t *grad = (grad_t *)realloc(t->grad, cap * sizeof(grad_t));
+    if (grad)
+      t->grad = grad;
+    unsigned char *op = (unsigned char *)realloc(t->op, cap);
+    if (op)
+      t->op = op;
+    int *start = (int *)realloc(t->child_start, (cap + 1) * sizeof(int));
+    if (start)
+      t->child_start = start;
+    Value **v = (Value **)realloc(t->nodes, cap * sizeof(Value *));
+    if (v)
+      t->nodes = v;
+    if (!data || !grad || !op || !start || !v)
+      return -1;
+    t->cap = cap;
+  }
+
+  int n_edges = t->child_start[t->n];
+  return grow_buffer((void **)&t->child_idx, &t->edge_cap, n_edges + edges,
+                     sizeof(int));
+}
+
+// append one record for v whose children are already on the tape
+static int tape_append(SoAGraph *t, Value *v, Op op) {
+  int i = t->n;
+  int e = t->child_start[i];
+
+  t->data[i] = v->data;
+  t->grad[i] = 0;
+  t->op[i] = (unsigned char)op;
+  t->nodes[i] = v;
+  if (op != OP_LEAF)
+    for (int j = 0; j < v->n_children; j++)
+      t->child_idx[e++] = v->children[j]->index;
+  t->child_start[i + 1] = e;
+
+  v->index = i;
+  t->n = i + 1;
+  return i;
+}
+
+// 1 if v already has a record on the tape
+static int on_tape(SoAGraph *t, Value *v) {
+  return v->index >= 0 && v->index < t->n && t->nodes[v->index] == v;
+}
+
+/**
+ * @brief Appends the record of a freshly built operator node
+ *
+ * Children without a record yet (leaves made before or during recording,
+ * or nodes built before tape_begin) are first appended as OP_LEAF records,
+ * so the tape never needs a sort. OP_CUSTOM nodes cannot be replayed from
+ * a record; meeting one (or running out of memory) marks the tape invalid
+ * rather than letting tape_reverse return wrong gradients.
+ *
+ * @param c Pointer to the new node
+ */
+static void tape_record(Value *c) {
+  SoAGraph *t = active_tape;
+  if (t->invalid)
+    return;
+  if (c->op == OP_CUSTOM ||
+      tape_reserve(t, c->n_children + 1, c->n_children) < 0) {
+    t->invalid = 1;
+    return;
+  }
+
+  for (int j = 0; j < c->n_children; j++)
+    if (!on_tape(t, c->children[j]))
+      tape_append(t, c->children[j], OP_LEAF);
+  tape_append(t, c, c->op);
+}
+
+/**
+ * @brief Performs the reverse pass by walking the tape backward
+ *
+ * The records are already in topological order, so this is soa_backward
+ * with `root` as the seed: no DFS, no visited marks. Gradients (and data)
+ * are then copied back into the recorded Values.
+ *
+ * @param t Pointer to the tape
+ * @param root Recorded node to differentiate
+ * @return 0 on success, -1 if root is not on the tape or the tape is invalid
+ * (it recorded an OP_CUSTOM node or ran out of memory); nothing is touched
+ * then and reverse must be used instead
+ */
+int tape_reverse(SoAGraph *t, Value *root) {
+  if (t->invalid || !on_tape(t, root))
+    return -1;
+
+  t->root = root->index;
+  soa_backward(t);
+  soa_store(t);
+  return 0;
+}
+
+/** ********** SERIALIZATION ********** **/
+
+#define SOA_FILE_MAGIC 0x4453474du // "MGSD" read little-endian
+#define SOA_FILE_VERSION 1
+
+/**
+  @struct SoAFileHeader
+  @brief  Start of a saved SoAGraph; every offset is from the start of the
+  file and a multiple of SOA_FILE_ALIGN
+  @param (magic: uint32_t) SOA_FILE_MAGIC; a byte-swapped value means the
+  file came from a machine with the other endianness
+  @param (version: uint32_t) SOA_FILE_VERSION
+  @param (scalar_size: uint32_t) sizeof(scalar_t) of the writer
+  @param (n: int32_t) number of nodes
+  @param (n_edges: int32_t) number of child indices
+  @param (root: int32_t) index of the output node
+  @param (data: uint64_t) offset of n scalar_t values (lane 0 of every node)
+  @param (op: uint64_t) offset of n op codes
+  @param (child_start: uint64_t) offset of n + 1 int32 edge offsets
+  @param (child_idx: uint64_t) offset of n_edges int32 child indices
+ */
+typedef struct SoAFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t scalar_size;
+  int32_t n;
+  int32_t n_edges;
+  int32_t root;
+  uint64_t data;
+  uint64_t op;
+  uint64_t child_start;
+  uint64_t child_idx;
+} SoAFileHeader;
+
+// round a file offset up to SOA_FILE_ALIGN
+static uint64_t soa_file_round(uint64_t off) {
+  return (off + SOA_FILE_ALIGN - 1) & ~(uint64_t)(SOA_FILE_ALIGN - 1);
+}
+
+// write `bytes` at `off`, zero-padding the file from `*pos` up to it
+static int soa_write_at(FILE *f, uint64_t *pos, uint64_t off, const void *p,
+                        size_t bytes) {
+  for (; *pos < off; (*pos)++)
+    if (fputc(0, f) == EOF)
+      return -1;
+  if (bytes && fwrite(p, 1, bytes, f) != bytes)
+    return -1;
+  *pos += bytes;
+  return 0;
+}
+
+/**
+ * @brief Writes a SoAGraph (or a tape) to a flat, pointer-free file
+ *
+ * The file is a fixed header followed by the data, op, child_start and
+ * child_idx arrays, each aligned to SOA_FILE_ALIGN, in native byte order.
+ * Only lane 0 of `data` is kept, and gradients are not saved. Because indices
+ * replace pointers, soa_map can use the arrays in place.
+ *
+ * @param g Pointer to the SoAGraph to save
+ * @param path Output file, created or truncated
+ * @return 0 on success, -1 on an I/O error or out of memory
+ */
+int soa_save(const SoAGraph *g, const char *path) {
+  int n = g->n, n_edges = g->child_start[g->n];
+  SoAFileHeader h = {SOA_FILE_MAGIC, SOA_FILE_VERSION, sizeof(scalar_t),
+                     n, n_edges, g->root, 0, 0, 0, 0};
+  h.data = soa_file_round(sizeof(h));
+  h.op = soa_file_round(h.data + (uint64_t)n * sizeof(scalar_t));
+  h.child_start = soa_file_round(h.op + n);
+  h.child_idx = soa_file_round(h.child_start + (uint64_t)(n + 1) * sizeof(int));
+
+  // data is strided by the batch; compact lane 0 unless it already is
+  scalar_t *lane0 = g->data;
+  if (g->batch > 1) {
+    lane0 = (scalar_t *)malloc(n * sizeof(scalar_t));
+    if (!lane0)
+      return -1;
+    for (int i = 0; i < n; i++)
+      lane0[i] = g->data[(size_t)i * g->batch];
+  }
+
+  FILE *f = fopen(path, "wb");
+  uint64_t pos = 0;
+  int err = !f ||
+            soa_write_at(f, &pos, 0, &h, sizeof(h)) ||
+            soa_write_at(f, &pos, h.data, lane0, n * sizeof(scalar_t)) ||
+            soa_write_at(f, &pos, h.op, g->op, n) ||
+            soa_write_at(f, &pos, h.child_start, g->child_start,
+                         (size_t)(n + 1) * sizeof(int)) ||
+            soa_write_at(f, &pos, h.child_idx, g->child_idx,
+                         (size_t)n_edges * sizeof(int));
+  if (f && fclose(f) != 0)
+    err = 1;
+  if (lane0 != g->data)
+    free(lane0);
+  return err ? -1 : 0;
+}
+
+/**
+ * @brief Maps a file written by soa_save back into a SoAGraph
+ *
+ * The file is mapped MAP_PRIVATE and the graph's arrays point straight into
+ * it, so loading costs one mmap plus a zeroed gradient buffer no matter how
+ * large the graph is. Pages are read on first touch, and writes (new leaf
+ * inputs, soa_forward results) are copy-on-write and never reach the file.
+ * Only the header is validated; the arrays are trusted. The graph has no
+ * source Values: address nodes by index through `data` / `grad`, in the
+ * order soa_compile produced.
+ *
+ * @param path File written by soa_save
+ * @return SoAGraph with batch 1, or NULL if the file can't be mapped or
+ * doesn't match this build
+ */
+SoAGraph *soa_map(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SoAFileHeader))
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  size_t size = st.st_size;
+  const SoAFileHeader *h = (const SoAFileHeader *)map;
+  int ok = h->magic == SOA_FILE_MAGIC && h->version == SOA_FILE_VERSION &&
+           h->scalar_size == sizeof(scalar_t) && h->n > 0 &&
+           h->n_edges >= 0 && h->root >= 0 && h->root < h->n &&
+           h->data + (uint64_t)h->n * sizeof(scalar_t) <= size &&
+           h->op + (uint64_t)h->n <= size &&
+           h->child_start + (uint64_t)(h->n + 1) * sizeof(int) <= size &&
+           h->child_idx + (uint64_t)h->n_edges * sizeof(int) <= size &&
+           (h->data | h->child_start | h->child_idx) % SOA_FILE_ALIGN == 0;
+
+  SoAGraph *g = ok ? (SoAGraph *)calloc(1, sizeof(SoAGraph)) : NULL;
+  grad_t *grad = g ? (grad_t *)calloc(h->n, sizeof(grad_t)) : NULL;
+  if (!grad) {
+    free(g);
+    munmap(map, size);
+    return NULL;
+  }
+
+  unsigned char *base = (unsigned char *)map;
+  g->n = h->n;
+  g->root = h->root;
+  g->batch = 1;
+  g->data = (scalar_t *)(base + h->data);
+  g->grad = grad;
+  g->op = base + h->op;
+  g->child_start = (int *)(base + h->child_start);
+  g->child_idx = (int *)(base + h->child_idx);
+  g->cap = h->n;
+  g->edge_cap = h->n_edges;
+  g->map = map;
+  g->map_size = size;
+  return g;
+}
+
+/** ********** CODE GENERATION ********** **/
+
+/**
+  @struct JitGraph
+  @brief  A SoAGraph's forward and backward pass emitted as straight-line C,
+  compiled to a shared object and loaded back
+  @param (lib: void) dlopen handle
+  @param (forward: fn) writes every node's data, lane by lane
+  @param (backward: fn) writes every node's grad from the current data
+  @param (n: int) number of nodes of the graph it was built from
+  @param (root: int) node whose gradient is seeded
+ */
+typedef struct JitGraph {
+  void *lib;
+  void (*forward)(scalar_t *data, int batch);
+  void (*backward)(const scalar_t *data, grad_t *grad, int batch);
+  int n;
+  int root;
+} JitGraph;
+
+// emit `lse`, the log-sum-exp of the n values v<z[j]>, as the shift in
+// soa_lse
+static void jit_emit_lse(FILE *f, const int *z, int n) {
+  fprintf(f, "      scalar_t m = v%d;\n", z[0]);
+  for (int j = 1; j < n; j++)
+    fprintf(f, "      m = v%d > m ? v%d : m;\n", z[j], z[j]);
+  fprintf(f, "      scalar_t s = 0;\n");
+  for (int j = 0; j < n; j++)
+    fprintf(f, "      s += EXP(v%d - m);\n", z[j]);
+  fprintf(f, "      const scalar_t lse = m + LOG(s);\n");
+}
+
+// emit the statements that compute v<i> from its children
+static void jit_emit_forward(FILE *f, const SoAGraph *g, int i) {
+  const int *ch = g->child_idx + g->child_start[i];
+  int n_ch = g->child_start[i + 1] - g->child_start[i];
+  int a = n_ch > 0 ? ch[0] : 0, b = n_ch > 1 ? ch[1] : 0;
+
+  switch (g->op[i]) {
+  case OP_ADD:
+    fprintf(f, "    const scalar_t v%d = v%d + v%d;\n", i, a, b);
+    break;
+  case OP_MUL:
+    fprintf(f, "    const scalar_t v%d = v%d * v%d;\n", i, a, b);
+    break;
+  case OP_PWR:
+    fprintf(f, "    const scalar_t v%d = POW(v%d, v%d);\n", i, a, b);
+    break;
+  case OP_RELU:
+    fprintf(f, "    const scalar_t v%d = v%d > 0 ? v%d : 0;\n", i, a, a);
+    break;
+  case OP_EXP:
+    fprintf(f, "    const scalar_t v%d = EXP(v%d);\n", i, a);
+    break;
+  case OP_LOG:
+    fprintf(f, "    const scalar_t v%d = LOG(v%d);\n", i, a);
+    break;
+  case OP_TANH:
+    fprintf(f, "    const scalar_t v%d = TANH(v%d);\n", i, a);
+    break;
+  case OP_SIGMOID:
+    fprintf(f, "    const scalar_t v%d = 1 / (1 + EXP(-v%d));\n", i, a);
+    break;
+  case OP_SOFTMAX_CE: {
+    int n = n_ch / 2;
+    fprintf(f, "    scalar_t v%d = 0;\n    {\n", i);
+    jit_emit_lse(f, ch, n);
+    for (int j = 0; j < n; j++)
+      fprintf(f, "      v%d += v%d * (lse - v%d);\n", i, ch[n + j], ch[j]);
+    fprintf(f, "    }\n");
+    break;
+  }
+  case OP_NEG:
+    fprintf(f, "    const scalar_t v%d = -v%d;\n", i, a);
+    break;
+  case OP_SUB:
+    fprintf(f, "    const scalar_t v%d = v%d - v%d;\n", i, a, b);
+    break;
+  case OP_DIV:
+    fprintf(f, "    const scalar_t v%d = v%d / v%d;\n", i, a, b);
+    break;
+  case OP_MUL_ADD:
+    fprintf(f, "    const scalar_t v%d = v%d * v%d + v%d;\n", i, a, b, ch[2]);
+    break;
+  case OP_LINEAR:
+  case OP_LINEAR_RELU: {
+    int n = (n_ch - 1) / 2;
+    fprintf(f, "    scalar_t v%d = v%d;\n", i, ch[2 * n]);
+    for (int j = 0; j < n; j++)
+      fprintf(f, "    v%d += v%d * v%d;\n", i, ch[j], ch[n + j]);
+    if (g->op[i] == OP_LINEAR_RELU)
+      fprintf(f, "    v%d = v%d > 0 ? v%d : 0;\n", i, i, i);
+    break;
+  }
+  case OP_SUM:
+  case OP_MEAN:
+    fprintf(f, "    scalar_t v%d = v%d;\n", i, a);
+    for (int j = 1; j < n_ch; j++)
+      fprintf(f, "    v%d += v%d;\n", i, ch[j]);
+    if (g->op[i] == OP_MEAN)
+      fprintf(f, "    v%d /= %d;\n", i, n_ch);
+    break;
+  case OP_DOT:
+    fprintf(f, "    scalar_t v%d = 0;\n", i);
+    for (int j = 0; j < n_ch / 2; j++)
+      fprintf(f, "    v%d += v%d * v%d;\n", i, ch[j], ch[n_ch / 2 + j]);
+    break;
+  default:
+    fprintf(f, "    const scalar_t v%d = D(%d);\n", i, i);
+    return;
+  }
+  fprintf(f, "    D(%d) = v%d;\n", i, i);
+}
+
+// emit the statements that push g<i> into its children's gradients
+static void jit_emit_backward(FILE *f, const SoAGraph *g, int i) {
+  const int *ch = g->child_idx + g->child_start[i];
+  int n_ch = g->child_start[i + 1] - g->child_start[i];
+  int a = n_ch > 0 ? ch[0] : 0, b = n_ch > 1 ? ch[1] : 0;
+
+  switch (g->op[i]) {
+  case OP_ADD:
+    fprintf(f, "    g%d += g%d;\n    g%d += g%d;\n", a, i, b, i);
+    break;
+  case OP_MUL:
+    fprintf(f, "    g%d += g%d * v%d;\n    g%d += g%d * v%d;\n", a, i, b, b, i,
+            a);
+    break;
+  case OP_PWR:
+    fprintf(f, "    g%d += v%d * POW(v%d, v%d - 1) * g%d;\n", a, b, a, b, i);
+    fprintf(f, "    if (v%d > 0)\n      g%d += LOG(v%d) * v%d * g%d;\n", a, b,
+            a, i, i);
+    break;
+  case OP_RELU:
+    fprintf(f, "    g%d += v%d > 0 ? g%d : 0;\n", a, a, i);
+    break;
+  case OP_EXP:
+    fprintf(f, "    g%d += g%d * v%d;\n", a, i, i);
+    break;
+  case OP_LOG:
+    fprintf(f, "    g%d += g%d / v%d;\n", a, i, a);
+    break;
+  case OP_TANH:
+    fprintf(f, "    g%d += g%d * (1 - v%d * v%d);\n", a, i, i, i);
+    break;
+  case OP_SIGMOID:
+    fprintf(f, "    g%d += g%d * v%d * (1 - v%d);\n", a, i, i, i);
+    break;
+  case OP_SOFTMAX_CE: {
+    int n = n_ch / 2;
+    fprintf(f, "    {\n");
+    jit_emit_lse(f, ch, n);
+    fprintf(f, "      scalar_t total = 0;\n");
+    for (int j = 0; j < n; j++)
+      fprintf(f, "      total += v%d;\n", ch[n + j]);
+    for (int j = 0; j < n; j++) {
+      int z = ch[j], y = ch[n + j];
+      fprintf(f, "      g%d += g%d * (EXP(v%d - lse) * total - v%d);\n", z, i,
+              z, y);
+      fprintf(f, "      g%d += g%d * (lse - v%d);\n", y, i, z);
+    }
+    fprintf(f, "    }\n");
+    break;
+  }
+  case OP_NEG:
+    fprintf(f, "    g%d -= g%d;\n", a, i);
+    break;
+  case OP_SUB:
+    fprintf(f, "    g%d += g%d;\n    g%d -= g%d;\n", a, i, b, i);
+    break;
+  case OP_DIV:
+    fprintf(f, "    g%d += g%d / v%d;\n", a, i, b);
+    fprintf(f, "    g%d -= g%d * v%d / v%d;\n", b, i, i, b);
+    break;
+  case OP_MUL_ADD:
+    fprintf(f, "    g%d += g%d * v%d;\n    g%d += g%d * v%d;\n", a, i, b, b, i,
+            a);
+    fprintf(f, "    g%d += g%d;\n", ch[2], i);
+    break;
+  case OP_LINEAR:
+  case OP_LINEAR_RELU: {
+    int n = (n_ch - 1) / 2;
+    const char *pad = g->op[i] == OP_LINEAR_RELU ? "  " : "";
+    if (g->op[i] == OP_LINEAR_RELU)
+      fprintf(f, "    if (v%d > 0) {\n", i);
+    for (int j = 0; j < n; j++) {
+      fprintf(f, "%s    g%d += g%d * v%d;\n", pad, ch[j], i, ch[n + j]);
+      fprintf(f, "%s    g%d += g%d * v%d;\n", pad, ch[n + j], i, ch[j]);
+    }
+    fprintf(f, "%s    g%d += g%d;\n", pad, ch[2 * n], i);
+    if (g->op[i] == OP_LINEAR_RELU)
+      fprintf(f, "    }\n");
+    break;
+  }
+  case OP_SUM:
+    for (int j = 0; j < n_ch; j++)
+      fprintf(f, "    g%d += g%d;\n", ch[j], i);
+    break;
+  case OP_MEAN:
+    for (int j = 0; j < n_ch; j++)
+      fprintf(f, "    g%d += (grad_t)1 / %d * g%d;\n", ch[j], n_ch, i);
+    break;
+  case OP_DOT:
+    for (int j = 0; j < n_ch / 2; j++) {
+      int x = ch[j], y = ch[n_ch / 2 + j];
+      fprintf(f, "    g%d += g%d * v%d;\n    g%d += g%d * v%d;\n", x, i, y, y,
+              i, x);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// emit loads of the children of nodes [lo, hi) that lie before lo, once
+// each; `seen` marks them with a stamp unique to the pass, so it is never
+// reset, and the backward pass also declares their gradients
+static void jit_emit_inputs(FILE *f, const SoAGraph *g, int lo, int hi,
+                            int *seen, int stamp, int grads) {
+  for (int i = lo; i < hi; i++)
+    for (int e = g->child_start[i]; e < g->child_start[i + 1]; e++) {
+      int c = g->child_idx[e];
+      if (c >= lo || seen[c] == stamp)
+        continue;
+      seen[c] = stamp;
+      fprintf(f, "    const scalar_t v%d = D(%d);\n", c, c);
+      if (grads)
+        fprintf(f, "    grad_t g%d = 0;\n", c);
+    }
+}
+
+// emit the write-back of the gradients jit_emit_inputs declared
+static void jit_emit_outputs(FILE *f, const SoAGraph *g, int lo, int hi,
+                             int *seen, int stamp) {
+  for (int i = lo; i < hi; i++)
+    for (int e = g->child_start[i]; e < g->child_start[i + 1]; e++) {
+      int c = g->child_idx[e];
+      if (c >= lo || seen[c] == stamp)
+        continue;
+      seen[c] = stamp;
+      fprintf(f, "    G(%d) += g%d;\n", c, c);
+    }
+}
+
+/**
+ * @brief Writes C source for a SoAGraph's forward and backward pass
+ *
+ * Every node becomes a local variable and every op a statement, in the
+ * graph's index order, so there is no dispatch left and the compiler can
+ * keep values in registers and fuse across nodes. The nodes are cut into
+ * functions of JIT_CHUNK nodes, since register allocation time grows faster
+ * than the function; values and gradients cross chunk boundaries through
+ * `data` and `grad`. Each function loops over the lanes around its
+ * straight-line body, with D(i) and G(i) lane l of node i. The arithmetic
+ * mirrors soa_forward and soa_backward, so results agree up to the order in
+ * which a gradient's contributions are summed.
+ *
+ * The source defines:
+ * - void mg_forward(scalar_t *data, int batch)
+ * - void mg_backward(const scalar_t *data, grad_t *grad, int batch)
+ *
+ * @param g Pointer to the SoAGraph
+ * @param f Stream to write to
+ * @return 0 on success, -1 on a write error or out of memory
+ */
+int jit_emit(const SoAGraph *g, FILE *f) {
+  int n_chunks = (g->n + JIT_CHUNK - 1) / JIT_CHUNK;
+  int *seen = (int *)calloc(g->n ? g->n : 1, sizeof(int));
+  if (!seen)
+    return -1;
+
+  int dbl = sizeof(scalar_t) == sizeof(double);
+  fprintf(f, "#include <math.h>\n#include <stddef.h>\n\n");
+  fprintf(f, "typedef %s scalar_t;\n", dbl ? "double" : "float");
+  fprintf(f, "typedef %s grad_t;\n",
+          sizeof(grad_t) == sizeof(double) ? "double" : "float");
+  fprintf(f, "#define POW %s\n#define LOG %s\n", dbl ? "pow" : "powf",
+          dbl ? "log" : "logf");
+  fprintf(f, "#define EXP %s\n#define TANH %s\n", dbl ? "exp" : "expf",
+          dbl ? "tanh" : "tanhf");
+  fprintf(f, "#define D(i) data[(size_t)(i) * batch + l]\n");
+  fprintf(f, "#define G(i) grad[(size_t)(i) * batch + l]\n\n");
+
+  for (int c = 0; c < n_chunks; c++) {
+    int lo = c * JIT_CHUNK;
+    int hi = lo + JIT_CHUNK < g->n ? lo + JIT_CHUNK : g->n;
+
+    fprintf(f, "static void forward_%d(scalar_t *restrict data, int batch) {\n",
+            c);
+    fprintf(f, "  for (int l = 0; l < batch; l++) {\n");
+    jit_emit_inputs(f, g, lo, hi, seen, 3 * c + 1, 0);
+    for (int i = lo; i < hi; i++)
+      jit_emit_forward(f, g, i);
+    fprintf(f, "  }\n}\n\n");
+
+    fprintf(f, "static void backward_%d(const scalar_t *restrict data,\n"
+               "                       grad_t *restrict grad, int batch) {\n",
+            c);
+    fprintf(f, "  for (int l = 0; l < batch; l++) {\n");
+    for (int i = lo; i < hi; i++)
+      fprintf(f, "    const scalar_t v%d = D(%d);\n    grad_t g%d = G(%d);\n",
+              i, i, i, i);
+    jit_emit_inputs(f, g, lo, hi, seen, 3 * c + 2, 1);
+    for (int i = hi - 1; i >= lo; i--)
+      jit_emit_backward(f, g, i);
+    for (int i = lo; i < hi; i++)
+      fprintf(f, "    G(%d) = g%d;\n", i, i);
+    jit_emit_outputs(f, g, lo, hi, seen, 3 * c + 3);
+    fprintf(f, "  }\n}\n\n");
+  }
+
+  fprintf(f, "void mg_forward(scalar_t *restrict data, int batch) {\n");
+  for (int c = 0; c < n_chunks; c++)
+    fprintf(f, "  forward_%d(data, batch);\n", c);
+  fprintf(f, "}\n\n");
+
+  fprintf(f, "void mg_backward(const scalar_t *restrict data,\n"
+             "                 grad_t *restrict grad, int batch) {\n");
+  fprintf(f, "  size_t n = (size_t)batch;\n");
+  fprintf(f, "  for (size_t i = 0; i < (size_t)%d * n; i++)\n", g->n);
+  fprintf(f, "    grad[i] = 0;\n");
+  fprintf(f, "  for (size_t l = 0; l < n; l++)\n");
+  fprintf(f, "    grad[(size_t)%d * n + l] = 1.0;\n", g->root);
+  for (int c = n_chunks - 1; c >= 0; c--)
+    fprintf(f, "  backward_%d(data, grad, batch);\n", c);
+  fprintf(f, "}\n");
+
+  free(seen);
+  return ferror(f) ? -1 : 0;
+}
+
+// append one character to the NUL-terminated command; -1 if it is full
+static int cmd_put(char *cmd, size_t cap, size_t *len, char c) {
+  if (*len + 1 >= cap)
+    return -1;
+  cmd[(*len)++] = c;
+  cmd[*len] = '\0';
+  return 0;
+}
+
+// append s to the command, as one single-quoted shell word when `quote` is
+// set (embedded quotes become '\''); -1 if it does not fit
+static int cmd_append(char *cmd, size_t cap, size_t *len, const char *s,
+                      int quote) {
+  int bad = quote ? cmd_put(cmd, cap, len, '\'') : 0;
+  for (; *s && !bad; s++) {
+    if (quote && *s == '\'') {
+      for (const char *e = "'\\''"; *e && !bad; e++)
+        bad = cmd_put(cmd, cap, len, *e);
+    } else {
+      bad = cmd_put(cmd, cap, len, *s);
+    }
+  }
+  if (quote && !bad)
+    bad = cmd_put(cmd, cap, len, '\'');
+  return bad;
+}
+
+/**
+ * @brief Generates, compiles and loads native code for a SoAGraph
+ *
+ * The source from jit_emit is written to a fresh directory under $TMPDIR
+ * (or /tmp), built with `$CC JIT_CFLAGS -shared` (cc when CC is unset) and
+ * dlopen'ed; the files are removed once loaded. CC is split by the shell
+ * as in make, while the paths are passed as quoted words, so any TMPDIR is
+ * safe. Compile time grows with the node count, so this pays off for
+ * fixed-shape graphs replayed many times. It removes per-node dispatch,
+ * which dominates at small batch sizes; with wide minibatches soa_forward /
+ * soa_backward already amortize it over the lanes and stream memory better.
+ * The code is bound to the graph's shape and root at this point, not to its
+ * values: refresh leaves with soa_load or soa_lanes as usual. With
+ * -DMICROGRAD_FAST_MATH the generated code still calls libm.
+ *
+ * @param g Pointer to the SoAGraph
+ * @return JitGraph object, or NULL if the compiler or loader failed
+ */
+JitGraph *jit_compile(const SoAGraph *g) {
+  const char *tmp = getenv("TMPDIR");
+  const char *cc = getenv("CC");
+  char dir[4096], src[4200], lib[4200], cmd[12800];
+  snprintf(dir, sizeof(dir), "%s/micrograd-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+  if (!mkdtemp(dir))
+    return NULL;
+  snprintf(src, sizeof(src), "%s/graph.c", dir);
+  snprintf(lib, sizeof(lib), "%s/graph.so", dir);
+
+  void *handle = NULL;
+  FILE *f = fopen(src, "w");
+  if (f) {
+    int bad = jit_emit(g, f) < 0;
+    bad |= fclose(f) != 0;
+    size_t len = 0;
+    cmd[0] = '\0';
+    bad |= cmd_append(cmd, sizeof(cmd), &len, cc && *cc ? cc : "cc", 0);
+    bad |= cmd_append(cmd, sizeof(cmd), &len,
+                      " " JIT_CFLAGS " -shared -fPIC -o ", 0);
+    bad |= cmd_append(cmd, sizeof(cmd), &len, lib, 1);
+    bad |= cmd_append(cmd, sizeof(cmd), &len, " ", 0);
+    bad |= cmd_append(cmd, sizeof(cmd), &len, src, 1);
+    bad |= cmd_append(cmd, sizeof(cmd), &len, " -lm", 0);
+    if (!bad && system(cmd) == 0)
+      handle = dlopen(lib, RTLD_NOW | RTLD_LOCAL);
+  }
+  remove(src);
+  remove(lib);
+  rmdir(dir);
+  if (!handle)
+    return NULL;
+
+  JitGraph *j = (JitGraph *)malloc(sizeof(JitGraph));
+  void *fwd = dlsym(handle, "mg_forward");
+  void *bwd = dlsym(handle, "mg_backward");
+  if (!j || !fwd || !bwd) {
+    free(j);
+    dlclose(handle);
+    return NULL;
+  }
+  j->lib = handle;
+  // POSIX guarantees object and function pointers convert through dlsym
+  *(void **)&j->forward = fwd;
+  *(void **)&j->backward = bwd;
+  j->n = g->n;
+  j->root = g->root;
+  return j;
+}
+
+/**
+  @brief recompute every node's lanes with the generated forward pass
+  @param (j: JitGraph) code built from g by jit_compile
+  @param (g: SoAGraph) graph whose data is updated in place
+ */
+void jit_forward(JitGraph *j, SoAGraph *g) { j->forward(g->data, g->batch); }
+
+/**
+ * @brief Runs the generated backward pass, then applies gradient clipping
+ *
+ * Matches soa_backward: every gradient is overwritten, the root (as it was
+ * at jit_compile) is seeded with 1, and clipping runs over the leaves.
+ *
+ * @param j Code built from g by jit_compile
+ * @param g Graph whose grad is updated in place
+ */
+void jit_backward(JitGraph *j, SoAGraph *g) {
+  j->backward(g->data, g->grad, g->batch);
+  soa_clip(g);
+}
+
+/**
+  @brief unload the generated code and free the JitGraph
+  @param (j: JitGraph) JitGraph object
+ */
+void jit_free(JitGraph *j) {
+  if (!j)
+    return;
+  dlclose(j->lib);
+  free(j);
+}
+
+/** ********** OPTIMIZERS ********** **/
+
+typedef enum OptimKind { OPTIM_SGD, OPTIM_MOMENTUM, OPTIM_ADAM } OptimKind;
+
+/**
+  @struct Optimizer
+  @brief  Update rule over a flat list of parameter leaves
+  @param (kind: OptimKind) SGD, SGD with momentum or Adam
+  @param (lr: grad_t) learning rate
+  @param (beta1: grad_t) momentum / Adam first-moment decay
+  @param (beta2: grad_t) Adam second-moment decay
+  @param (eps: grad_t) Adam denominator guard
+  @param (t: int) number of steps taken; drives Adam's bias correction
+  @param (params: [Value]) registered leaves
+  @param (m: [grad_t]) momentum / first moment of every parameter
+  @param (v: [grad_t]) Adam second moment of every parameter
+  @param (n: int) number of registered parameters
+  @param (cap: int) capacity of every array
+ */
+typedef struct Optimizer {
+  OptimKind kind;
+  grad_t lr;
+  grad_t beta1;
+  grad_t beta2;
+  grad_t eps;
+  int t;
+
+  Value **params;
+  grad_t *m;
+  grad_t *v;
+  int n;
+  int cap;
+} Optimizer;
+
+/**
+  @brief create an optimizer with no parameters
+  @param (kind: OptimKind) update rule
+  @param (lr: grad_t) learning rate
+  @returns Optimizer object with beta1 0.9, beta2 0.999 and eps 1e-8, or NULL
+  if out of memory
+ */
+Optimizer *optim_create(OptimKind kind, grad_t lr) {
+  Optimizer *opt = (Optimizer *)calloc(1, sizeof(Optimizer));
+  if (!opt)
+    return NULL;
+
+  opt->kind = kind;
+  opt->lr = lr;
+  opt->beta1 = 0.9;
+  opt->beta2 = 0.999;
+  opt->eps = 1e-8;
+  return opt;
+}
+
+/**
+  @brief free an optimizer and its state; the parameters are left alone
+  @param (opt: Optimizer) Optimizer object
+ */
+void optim_free(Optimizer *opt) {
+  if (!opt)
+    return;
+  free(opt->params);
+  free(opt->m);
+  free(opt->v);
+  free(opt);
+}
+
+// make room for `need` parameters; new optimizer state starts at 0
+static int optim_reserve(Optimizer *opt, int need) {
+  if (need <= opt->cap)
+    return 0;
+
+  int cap = opt->cap ? opt->cap : TOPO_INIT_CAP;
+  while (cap < need)
+    cap *= 2;
+
+  Value **params = (Value **)realloc(opt->params, cap * sizeof(Value *));
+  if (params)
+    opt->params = params;
+  grad_t *m = (grad_t *)realloc(opt->m, cap * sizeof(grad_t));
+  if (m)
+    opt->m = m;
+  grad_t *v = (grad_t *)realloc(opt->v, cap * sizeof(grad_t));
+  if (v)
+    opt->v = v;
+  if (!params || !m || !v)
+    return -1;
+
+  for (int i = opt->cap; i < cap; i++)
+    opt->m[i] = opt->v[i] = 0;
+  opt->cap = cap;
+  return 0;
+}
+
+/**
+  @brief register parameter leaves with an optimizer
+  @param (opt: Optimizer) Optimizer object
+  @param (params: [Value]) leaves to update on every step
+  @param (n: int) number of leaves
+  @returns 0 on success, -1 if out of memory
+ */
+int optim_add(Optimizer *opt, Value **params, int n) {
+  if (optim_reserve(opt, opt->n + n) < 0)
+    return -1;
+  for (int i = 0; i < n; i++)
+    opt->params[opt->n + i] = params[i];
+  opt->n += n;
+  return 0;
+}
+
+/**
+   Update kernels. Values keep data and grad inline, so each kernel reads and
+   writes them in place through the params array in one fused pass, with the
+   update rule hoisted out of the loop and the optimizer state contiguous.
+   Gathering into flat copies would add two more sweeps over the same memory.
+*/
+
+// w -= lr * g
+static void sgd_kernel(Value *const *p, int n, grad_t lr) {
+  for (int i = 0; i < n; i++) {
+    p[i]->data -= lr * p[i]->grad;
+    p[i]->grad = 0;
+  }
+}
+
+// m = mu * m + g; w -= lr * m
+static void momentum_kernel(Value *const *p, grad_t *restrict m, int n,
+                            grad_t lr, grad_t mu) {
+  for (int i = 0; i < n; i++) {
+    m[i] = mu * m[i] + p[i]->grad;
+    p[i]->data -= lr * m[i];
+    p[i]->grad = 0;
+  }
+}
+
+// Adam with the bias correction folded into lr_t
+static void adam_kernel(Value *const *p, grad_t *restrict m,
+                        grad_t *restrict v, int n, grad_t lr_t, grad_t b1,
+                        grad_t b2, grad_t eps) {
+  for (int i = 0; i < n; i++) {
+    grad_t g = p[i]->grad;
+    m[i] = b1 * m[i] + (1 - b1) * g;
+    v[i] = b2 * v[i] + (1 - b2) * g * g;
+    p[i]->data -= lr_t * m[i] / (SQRT(v[i]) + eps);
+    p[i]->grad = 0;
+  }
+}
+
+/**
+ * @brief Applies one update to every registered parameter and zeroes its grad
+ *
+ * One sweep over the flat params array (no graph walk) updates each
+ * parameter in place and zeroes its grad for the next reverse.
+ *
+ * @param opt Pointer to the Optimizer
+ */
+void optim_step(Optimizer *opt) {
+  int n = opt->n;
+  Value **p = opt->params;
+
+  opt->t++;
+  switch (opt->kind) {
+  case OPTIM_SGD:
+    sgd_kernel(p, n, opt->lr);
+    break;
+  case OPTIM_MOMENTUM:
+    momentum_kernel(p, opt->m, n, opt->lr, opt->beta1);
+    break;
+  case OPTIM_ADAM: {
+    grad_t c1 = 1 - pow(opt->beta1, opt->t);
+    grad_t c2 = 1 - pow(opt->beta2, opt->t);
+    adam_kernel(p, opt->m, opt->v, n, opt->lr * SQRT(c2) / c1, opt->beta1,
+                opt->beta2, opt->eps);
+    break;
+  }
+  }
+}
+
+/** ********** DATA PARALLEL ********** **/
+
+typedef enum CommKind { COMM_SHM, COMM_TCP } CommKind;
+
+/**
+  @struct ShmRegion
+  @brief  Start of the mapping shared by the workers of comm_fork; the slots
+  follow it, cache-line aligned
+  @param (barrier: pthread_barrier_t) process-shared barrier of all workers
+ */
+typedef struct ShmRegion {
+  pthread_barrier_t barrier;
+} ShmRegion;
+
+/**
+  @struct Comm
+  @brief  Communicator: one worker's view of a group of `size` workers
+  @param (kind: CommKind) shared memory between forked processes, or a TCP
+  ring between hosts
+  @param (rank: int) this worker, 0 .. size - 1
+  @param (size: int) number of workers
+  @param (shm: ShmRegion) COMM_SHM: shared mapping
+  @param (shm_bytes: size_t) COMM_SHM: size of the mapping
+  @param (slots: [grad_t]) COMM_SHM: COMM_SHM_CAP values per rank
+  @param (result: [grad_t]) COMM_SHM: COMM_SHM_CAP reduced values
+  @param (children: [pid_t]) COMM_SHM, rank 0: pids of ranks 1 .. size - 1
+  @param (next_fd: int) COMM_TCP: socket to rank + 1
+  @param (prev_fd: int) COMM_TCP: socket from rank - 1
+  @param (scratch: [grad_t]) COMM_TCP: receive buffer of the ring
+  @param (scratch_cap: int) COMM_TCP: capacity of scratch
+ */
+typedef struct Comm {
+  CommKind kind;
+  int rank;
+  int size;
+
+  ShmRegion *shm;
+  size_t shm_bytes;
+  grad_t *slots;
+  grad_t *result;
+  pid_t *children;
+
+  int next_fd;
+  int prev_fd;
+  grad_t *scratch;
+  int scratch_cap;
+} Comm;
+
+/**
+ * @brief Forks n_workers - 1 copies of the process, joined by shared memory
+ *
+ * Like fork, this returns in every worker: rank 0 is the caller and ranks
+ * 1 .. n_workers - 1 are the children, which run on from the same point and
+ * usually pick their data shard from `rank`. Call it before starting any
+ * thread (a WorkerPool, a DataParallel). Every worker ends with comm_free;
+ * rank 0's call waits for the others, so they should exit after theirs.
+ *
+ * @param n_workers Number of workers, at least 1
+ * @return Comm object, or NULL if the mapping or a fork failed
+ */
+Comm *comm_fork(int n_workers) {
+  Comm *c = (Comm *)calloc(1, sizeof(Comm));
+  pid_t *children = (pid_t *)calloc(n_workers, sizeof(pid_t));
+  if (!c || !children) {
+    free(c);
+    free(children);
+    return NULL;
+  }
+
+  size_t head = (sizeof(ShmRegion) + 63) & ~(size_t)63;
+  size_t bytes = head + (size_t)(n_workers + 1) * COMM_SHM_CAP * sizeof(grad_t);
+  // a shared mapping of /dev/zero is anonymous memory that survives fork
+  int fd = open("/dev/zero", O_RDWR);
+  void *p = fd < 0 ? MAP_FAILED
+                   : mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0);
+  if (fd >= 0)
+    close(fd);
+  if (p == MAP_FAILED) {
+    free(children);
+    free(c);
+    return NULL;
+  }
+
+  c->kind = COMM_SHM;
+  c->size = n_workers;
+  c->shm = (ShmRegion *)p;
+  c->shm_bytes = bytes;
+  c->slots = (grad_t *)((unsigned char *)p + head);
+  c->result = c->slots + (size_t)n_workers * COMM_SHM_CAP;
+  c->next_fd = c->prev_fd = -1;
+
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  int rc = pthread_barrier_init(&c->shm->barrier, &attr, n_workers);
+  pthread_barrierattr_destroy(&attr);
+  if (rc != 0) {
+    munmap(p, bytes);
+    free(children);
+    free(c);
+    return NULL;
+  }
+
+  for (int r = 1; r < n_workers; r++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      free(children);
+      c->rank = r;
+      return c;
+    }
+    if (pid < 0) {
+      // the forked workers would wait at the first barrier forever
+      for (int k = 1; k < r; k++) {
+        kill(children[k], SIGKILL);
+        waitpid(children[k], NULL, 0);
+      }
+      pthread_barrier_destroy(&c->shm->barrier);
+      munmap(p, bytes);
+      free(children);
+      free(c);
+      return NULL;
+    }
+    children[r] = pid;
+  }
+  c->children = children;
+  return c;
+}
+
+// disable Nagle and make a connected socket non-blocking; closes it and
+// returns -1 on failure
+static int comm_socket_options(int fd) {
+  int one = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// listening socket on `port` of every local address, or -1
+static int comm_listen(int port) {
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  struct addrinfo hints = {0}, *res;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(NULL, service, &hints, &res) != 0)
+    return -1;
+
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  int one = 1;
+  if (fd >= 0 &&
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+       bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 1) < 0)) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+// connect to host:port, retrying while the peer is not listening yet
+static int comm_connect(const char *host, int port) {
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  struct addrinfo hints = {0}, *res;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, service, &hints, &res) != 0)
+    return -1;
+
+  int fd = -1;
+  for (int tries = 0; fd < 0 && tries < COMM_CONNECT_TRIES; tries++) {
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+      struct timespec wait = {0, 10 * 1000 * 1000};
+      nanosleep(&wait, NULL);
+    }
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+/**
+ * @brief Joins a ring of workers over TCP
+ *
+ * Rank r listens on port + r, connects to rank r + 1 at hosts[(r + 1) %
+ * size] and accepts rank r - 1, so every worker can start in any order
+ * (connects are retried for about COMM_CONNECT_TRIES * 10 ms). All workers
+ * must pass the same hosts and port.
+ *
+ * @param rank This worker, 0 .. size - 1
+ * @param size Number of workers
+ * @param hosts Host name or address of every rank
+ * @param port Base port
+ * @return Comm object, or NULL if a socket could not be set up
+ */
+Comm *comm_tcp(int rank, int size, const char *const *hosts, int port) {
+  Comm *c = (Comm *)calloc(1, sizeof(Comm));
+  if (!c)
+    return NULL;
+  c->kind = COMM_TCP;
+  c->rank = rank;
+  c->size = size;
+  c->next_fd = c->prev_fd = -1;
+  if (size == 1)
+    return c;
+
+  int next = (rank + 1) % size;
+  int listen_fd = comm_listen(port + rank);
+  if (listen_fd >= 0) {
+    c->next_fd = comm_connect(hosts[next], port + next);
+    if (c->next_fd >= 0)
+      c->prev_fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+  }
+  if (c->next_fd >= 0)
+    c->next_fd = comm_socket_options(c->next_fd);
+  if (c->prev_fd >= 0)
+    c->prev_fd = comm_socket_options(c->prev_fd);
+  if (c->next_fd < 0 || c->prev_fd < 0) {
+    if (c->next_fd >= 0)
+      close(c->next_fd);
+    if (c->prev_fd >= 0)
+      close(c->prev_fd);
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+/**
+  @brief leave the group and free the communicator; rank 0 of comm_fork also
+  waits for the other workers to exit
+  @param (c: Comm) Comm object
+ */
+void comm_free(Comm *c) {
+  if (!c)
+    return;
+  if (c->kind == COMM_SHM) {
+    if (c->rank == 0) {
+      for (int r = 1; r < c->size; r++)
+        waitpid(c->children[r], NULL, 0);
+      pthread_barrier_destroy(&c->shm->barrier);
+    }
+    munmap(c->shm, c->shm_bytes);
+    free(c->children);
+  } else {
+    if (c->next_fd >= 0)
+      close(c->next_fd);
+    if (c->prev_fd >= 0)
+      close(c->prev_fd);
+    free(c->scratch);
+  }
+  free(c);
+}
+
+/**
+ * @brief Shared-memory all-reduce in pieces of COMM_SHM_CAP values
+ *
+ * Every rank publishes its piece in its slot; after a barrier, rank r sums
+ * the r-th share of every slot into `result`, so all ranks reduce in
+ * parallel, and after a second barrier everyone copies the result back. The
+ * third barrier keeps the next piece from overwriting slots still in use.
+ */
+static void shm_allreduce(Comm *c, grad_t *buf, size_t n) {
+  int size = c->size, r = c->rank;
+  grad_t *mine = c->slots + (size_t)r * COMM_SHM_CAP;
+
+  for (size_t off = 0; off < n; off += COMM_SHM_CAP) {
+    size_t m = n - off < COMM_SHM_CAP ? n - off : COMM_SHM_CAP;
+    for (size_t j = 0; j < m; j++)
+      mine[j] = buf[off + j];
+    pthread_barrier_wait(&c->shm->barrier);
+
+    size_t lo = m * r / size, hi = m * (r + 1) / size;
+    for (size_t j = lo; j < hi; j++)
+      c->result[j] = c->slots[j];
+    for (int k = 1; k < size; k++) {
+      const grad_t *slot = c->slots + (size_t)k * COMM_SHM_CAP;
+      for (size_t j = lo; j < hi; j++)
+        c->result[j] += slot[j];
+    }
+    pthread_barrier_wait(&c->shm->barrier);
+
+    for (size_t j = 0; j < m; j++)
+      buf[off + j] = c->result[j];
+    pthread_barrier_wait(&c->shm->barrier);
+  }
+}
+
+// send `sb` bytes to the next rank while receiving `rb` from the previous
+// one; doing both at once keeps a ring of full socket buffers from blocking
+static int ring_exchange(Comm *c, const void *send, size_t sb, void *recv,
+                         size_t rb) {
+  const unsigned char *s = (const unsigned char *)send;
+  unsigned char *r = (unsigned char *)recv;
+
+  while (sb || rb) {
+    struct pollfd fds[2] = {{c->next_fd, sb ? POLLOUT : 0, 0},
+                            {c->prev_fd, rb ? POLLIN : 0, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (sb && fds[0].revents) {
+      ssize_t k = write(c->next_fd, s, sb);
+      if (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return -1;
+      if (k > 0) {
+        s += k;
+        sb -= k;
+      }
+    }
+    if (rb && fds[1].revents) {
+      ssize_t k = read(c->prev_fd, r, rb);
+      if (k == 0 ||
+          (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return -1;
+      if (k > 0) {
+        r += k;
+        rb -= k;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Ring all-reduce: reduce-scatter, then all-gather
+ *
+ * The buffer is cut into `size` segments. In size - 1 steps every rank
+ * passes one segment on and adds the one it receives, after which rank r
+ * holds the full sum of segment r + 1; size - 1 more steps circulate the
+ * sums. Each rank sends 2 (size - 1) / size of the buffer in total, however
+ * many ranks there are, and every rank ends with the same bits.
+ */
+static int tcp_allreduce(Comm *c, grad_t *buf, size_t n) {
+  int size = c->size, r = c->rank;
+  if (grow_buffer((void **)&c->scratch, &c->scratch_cap, (int)(n / size + 1),
+                  sizeof(grad_t)) < 0)
+    return -1;
+
+  for (int s = 0; s < size - 1; s++) {
+    int out = (r - s + size) % size, in = (r - s - 1 + size) % size;
+    size_t out_lo = n * out / size, out_hi = n * (out + 1) / size;
+    size_t in_lo = n * in / size, in_hi = n * (in + 1) / size;
+    if (ring_exchange(c, buf + out_lo, (out_hi - out_lo) * sizeof(grad_t),
+                      c->scratch, (in_hi - in_lo) * sizeof(grad_t)) < 0)
+      return -1;
+    for (size_t j = 0; j < in_hi - in_lo; j++)
+      buf[in_lo + j] += c->scratch[j];
+  }
+  for (int s = 0; s < size - 1; s++) {
+    int out = (r + 1 - s + size) % size, in = (r - s + size) % size;
+    size_t out_lo = n * out / size, out_hi = n * (out + 1) / size;
+    size_t in_lo = n * in / size, in_hi = n * (in + 1) / size;
+    if (ring_exchange(c, buf + out_lo, (out_hi - out_lo) * sizeof(grad_t),
+                      buf + in_lo, (in_hi - in_lo) * sizeof(grad_t)) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+  @brief replace buf on every rank with the element-wise sum over all ranks;
+  every rank must call it with the same n
+  @param (c: Comm) Comm object
+  @param (buf: [grad_t]) values to reduce, in place
+  @param (n: size_t) number of values
+  @returns 0 on success, -1 if a peer was lost
+ */
+int comm_allreduce(Comm *c, grad_t *buf, size_t n) {
+  if (c->size == 1 || n == 0)
+    return 0;
+  if (c->kind == COMM_SHM) {
+    shm_allreduce(c, buf, n);
+    return 0;
+  }
+  return tcp_allreduce(c, buf, n);
+}
+
+/**
+  @struct DpSlot
+  @brief  A parameter and the position in the topological order at which the
+  backward pass is done with its gradient
+ */
+typedef struct DpSlot {
+  int pos;
+  int param;
+} DpSlot;
+
+/**
+  @struct DataParallel
+  @brief  Averages parameter gradients across the workers of a Comm
+  @param (comm: Comm) communicator
+  @param (params: [Value]) parameter leaves, in the same order on every rank
+  @param (n: int) number of parameters
+  @param (slots: [DpSlot]) parameters in the order their gradients finish
+  @param (buf: [grad_t]) gradients gathered in slots order
+  @param (thread: pthread_t) comm thread, which reduces submitted buckets
+  @param (submitted: int) buckets handed to the comm thread
+  @param (done: int) buckets reduced
+  @param (stop: int) set by dp_free to end the comm thread
+  @param (failed: int) set if a reduce failed
+ */
+typedef struct DataParallel {
+  Comm *comm;
+  Value **params;
+  int n;
+  DpSlot *slots;
+  grad_t *buf;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int submitted;
+  int done;
+  int stop;
+  int failed;
+} DataParallel;
+
+// reduce buckets in submission order until dp_free stops the thread
+static void *dp_thread(void *arg) {
+  DataParallel *dp = (DataParallel *)arg;
+
+  pthread_mutex_lock(&dp->lock);
+  for (;;) {
+    while (dp->done == dp->submitted && !dp->stop)
+      pthread_cond_wait(&dp->cond, &dp->lock);
+    if (dp->done == dp->submitted)
+      break;
+    size_t lo = (size_t)dp->done * DP_BUCKET;
+    size_t hi = lo + DP_BUCKET < (size_t)dp->n ? lo + DP_BUCKET : (size_t)dp->n;
+    pthread_mutex_unlock(&dp->lock);
+
+    int rc = comm_allreduce(dp->comm, dp->buf + lo, hi - lo);
+
+    pthread_mutex_lock(&dp->lock);
+    dp->failed |= rc < 0;
+    dp->done++;
+    pthread_cond_broadcast(&dp->cond);
+  }
+  pthread_mutex_unlock(&dp->lock);
+  return NULL;
+}
+
+/**
+ * @brief Sets up gradient averaging of params over comm
+ *
+ * Starts the comm thread that runs the all-reduces, so communication can
+ * overlap with the backward pass in dp_backward. Every rank must register
+ * the same parameters in the same order (e.g. an MLP's params array).
+ *
+ * @param comm Communicator, shared with nothing else while in use
+ * @param params Parameter leaves
+ * @param n Number of parameters
+ * @return DataParallel object, or NULL if out of memory
+ */
+DataParallel *dp_create(Comm *comm, Value **params, int n) {
+  DataParallel *dp = (DataParallel *)calloc(1, sizeof(DataParallel));
+  if (!dp)
+    return NULL;
+  dp->comm = comm;
+  dp->n = n;
+  dp->params = (Value **)malloc((n ? n : 1) * sizeof(Value *));
+  dp->slots = (DpSlot *)malloc((n ? n : 1) * sizeof(DpSlot));
+  dp->buf = (grad_t *)malloc((n ? n : 1) * sizeof(grad_t));
+  pthread_mutex_init(&dp->lock, NULL);
+  pthread_cond_init(&dp->cond, NULL);
+  if (!dp->params || !dp->slots || !dp->buf ||
+      pthread_create(&dp->thread, NULL, dp_thread, dp) != 0) {
+    pthread_mutex_destroy(&dp->lock);
+    pthread_cond_destroy(&dp->cond);
+    free(dp->params);
+    free(dp->slots);
+    free(dp->buf);
+    free(dp);
+    return NULL;
+  }
+
+  for (int k = 0; k < n; k++) {
+    dp->params[k] = params[k];
+    dp->slots[k] = (DpSlot){0, k};
+  }
+  return dp;
+}
+
+/**
+  @brief stop the comm thread and free a DataParallel; the Comm and the
+  parameters are left alone
+  @param (dp: DataParallel) DataParallel object
+ */
+void dp_free(DataParallel *dp) {
+  if (!dp)
+    return;
+  pthread_mutex_lock(&dp->lock);
+  dp->stop = 1;
+  pthread_cond_broadcast(&dp->cond);
+  pthread_mutex_unlock(&dp->lock);
+  pthread_join(dp->thread, NULL);
+
+  pthread_mutex_destroy(&dp->lock);
+  pthread_cond_destroy(&dp->cond);
+  free(dp->params);
+  free(dp->slots);
+  free(dp->buf);
+  free(dp);
+}
+
+// gather the next bucket of finished gradients and pass it to the comm thread
+static void dp_submit(DataParallel *dp) {
+  int lo = dp->submitted * DP_BUCKET;
+  int hi = lo + DP_BUCKET < dp->n ? lo + DP_BUCKET : dp->n;
+  for (int k = lo; k < hi; k++)
+    dp->buf[k] = dp->params[dp->slots[k].param]->grad;
+
+  pthread_mutex_lock(&dp->lock);
+  dp->submitted++;
+  pthread_cond_broadcast(&dp->cond);
+  pthread_mutex_unlock(&dp->lock);
+}
+
+// submit what is left, wait for the comm thread, then scatter the averages
+static int dp_finish(DataParallel *dp) {
+  while ((size_t)dp->submitted * DP_BUCKET < (size_t)dp->n)
+    dp_submit(dp);
+
+  pthread_mutex_lock(&dp->lock);
+  while (dp->done < dp->submitted)
+    pthread_cond_wait(&dp->cond, &dp->lock);
+  int failed = dp->failed;
+  dp->submitted = dp->done = dp->failed = 0;
+  pthread_mutex_unlock(&dp->lock);
+
+  grad_t scale = (grad_t)1 / dp->comm->size;
+  for (int k = 0; k < dp->n; k++)
+    dp->params[dp->slots[k].param]->grad = dp->buf[k] * scale;
+  return failed ? -1 : 0;
+}
+
+/**
+  @brief average the current gradients of the parameters over all ranks,
+  e.g. after reverse or tape_reverse (which clip before the reduce)
+  @param (dp: DataParallel) DataParallel object
+  @returns 0 on success, -1 if a peer was lost
+ */
+int dp_allreduce(DataParallel *dp) {
+  for (int k = 0; k < dp->n; k++)
+    dp->slots[k] = (DpSlot){0, k};
+  return dp_finish(dp);
+}
+
+// later positions finish first; ties keep registration order
+static int dp_slot_cmp(const void *a, const void *b) {
+  const DpSlot *x = (const DpSlot *)a, *y = (const DpSlot *)b;
+  if (x->pos != y->pos)
+    return x->pos > y->pos ? -1 : 1;
+  return x->param - y->param;
+}
+
+/**
+ * @brief graph_backward with the gradient all-reduce overlapped
+ *
+ * A leaf comes before all of its parents in the captured order, so its
+ * gradient is final once the reverse walk reaches its position. Parameters
+ * are sorted by that position, and every DP_BUCKET finished gradients are
+ * handed to the comm thread while the walk goes on toward the early nodes.
+ * The last buckets go out when the walk ends. Averaged gradients are
+ * written back, then clipping runs, so the clip sees the global gradient.
+ * Every rank must replay the same graph shape.
+ *
+ * @param dp Pointer to the DataParallel
+ * @param g Compiled graph holding the parameters
+ * @return 0 on success, -1 if a peer was lost
+ */
+int dp_backward(DataParallel *dp, Graph *g) {
+  Value **order = g->order;
+  int size = g->size;
+  for (int i = 0; i < size; i++) {
+    order[i]->grad = 0;
+    order[i]->index = i;
+  }
+  g->root->grad = 1.0;
+
+  // parameters the graph does not reach are final from the start
+  for (int k = 0; k < dp->n; k++) {
+    Value *p = dp->params[k];
+    int in_graph = p->index >= 0 && p->index < size && order[p->index] == p;
+    dp->slots[k] = (DpSlot){in_graph ? p->index : size, k};
+  }
+  qsort(dp->slots, dp->n, sizeof(DpSlot), dp_slot_cmp);
+
+  int finished = 0;
+  for (int i = size - 1; i >= 0; i--) {
+    if (order[i]->reverse && (order[i]->flags & VALUE_REQUIRES_GRAD))
+      REVERSE_NODE(order[i]);
+    while (finished < dp->n && dp->slots[finished].pos >= i)
+      finished++;
+    while (finished >= (dp->submitted + 1) * DP_BUCKET)
+      dp_submit(dp);
+  }
+
+  int rc = dp_finish(dp);
+  clip_leaves(order, size);
+  return rc;
+}
+
+/** ********** NEURAL NETWORK ********** **/
+
+/**
+  @struct Layer
+  @brief  Fully connected layer whose parameters live in one block
+  @param (n_in: int) fan-in of every neuron
+  @param (n_out: int) number of neurons
+  @param (relu: int) 1 for relu(Wx + b) neurons, 0 for Wx + b
+  @param (params: [Value]) n_out * n_in weights (row j feeds neuron j)
+  followed by n_out biases; pass to optim_add
+  @param (n_params: int) number of parameters
+  @param (store: [Value]) the parameter nodes themselves
+ */
+typedef struct Layer {
+  int n_in;
+  int n_out;
+  int relu;
+
+  Value **params;
+  int n_params;
+  Value *store;
+} Layer;
+
+// xorshift32 step mapped to [-1, 1)
+static scalar_t layer_uniform(unsigned int *state) {
+  unsigned int x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return (scalar_t)(x >> 8) / (1 << 23) - 1;
+}
+
+/**
+ * @brief Allocates a layer with its parameter nodes preallocated
+ *
+ * The header, the parameter Values and the pointer array handed to the
+ * operators come from a single malloc, so a layer costs no per-parameter
+ * allocations. Parameters start uniform in [-1, 1) with a zero bias. They
+ * are marked VALUE_OWNED and hold a reference, so free_graph on a loss
+ * never frees them; layer_free does.
+ *
+ * @param n_in Fan-in of every neuron
+ * @param n_out Number of neurons
+ * @param relu 1 to gate every neuron with relu
+ * @param seed Random state for the initialization (must be nonzero);
+ * advanced in place
+ * @return Pointer to the new Layer, or NULL if out of memory
+ */
+Layer *layer_create(int n_in, int n_out, int relu, unsigned int *seed) {
+  int n = n_out * (n_in + 1);
+  size_t bytes = sizeof(Layer) + n * (sizeof(Value) + sizeof(Value *));
+  Layer *l = (Layer *)malloc(bytes);
+  if (!l)
+    return NULL;
+
+  l->n_in = n_in;
+  l->n_out = n_out;
+  l->relu = relu;
+  l->store = (Value *)(l + 1);
+  l->params = (Value **)(l->store + n);
+  l->n_params = n;
+
+  for (int i = 0; i < n; i++) {
+    Value *v = &l->store[i];
+    v->data = i < n_out * n_in ? layer_uniform(seed) : 0;
+    v->grad = 0;
+    v->tangent = 0;
+    v->children = NULL;
+    v->n_children = 0;
+    v->reverse = NULL;
+    v->forward = NULL;
+    v->visit = 0;
+    v->op = OP_LEAF;
+    v->index = -1;
+    v->refs = 1;
+    v->flags = VALUE_OWNED | VALUE_REQUIRES_GRAD;
+    l->params[i] = v;
+  }
+  return l;
+}
+
+/**
+  @brief free a layer and its parameters; graphs built from it must already
+  be freed
+  @param (l: Layer) Layer object
+ */
+void layer_free(Layer *l) { free(l); }
+
+/**
+  @brief apply the layer to an input vector, one fused node per neuron
+  @param (l: Layer) Layer object
+  @param (x: [Value]) n_in inputs
+  @param (out: [Value]) receives the n_out outputs
+ */
+void layer_forward(Layer *l, Value **x, Value **out) {
+  Value **b = l->params + l->n_out * l->n_in;
+  for (int j = 0; j < l->n_out; j++) {
+    Value **w = l->params + j * l->n_in;
+    out[j] = l->relu ? linear_relu(w, x, b[j], l->n_in)
+                     : linear(w, x, b[j], l->n_in);
+  }
+}
+
+/**
+  @struct MLP
+  @brief  Stack of Layers: relu hidden layers and a linear output layer
+  @param (layers: [Layer]) the layers, input side first
+  @param (n_layers: int) number of layers
+  @param (params: [Value]) every layer's parameters; pass to optim_add
+  @param (n_params: int) number of parameters
+  @param (acts: [Value]) two activation buffers of the widest layer, reused
+  by every forward
+  @param (width: int) widest layer
+ */
+typedef struct MLP {
+  Layer **layers;
+  int n_layers;
+  Value **params;
+  int n_params;
+  Value **acts;
+  int width;
+} MLP;
+
+/**
+  @brief free an MLP and all of its layers
+  @param (m: MLP) MLP object
+ */
+void mlp_free(MLP *m) {
+  if (!m)
+    return;
+  for (int i = 0; i < m->n_layers; i++)
+    layer_free(m->layers[i]);
+  free(m->layers);
+  free(m->params);
+  free(m->acts);
+  free(m);
+}
+
+/**
+ * @brief Allocates an MLP of fully connected layers
+ *
+ * @param n_in Number of inputs
+ * @param sizes Width of every layer; the last one is the output
+ * @param n_layers Number of layers
+ * @param seed Random seed for the initialization (0 picks a fixed default)
+ * @return Pointer to the new MLP, or NULL if out of memory
+ */
+MLP *mlp_create(int n_in, const int *sizes, int n_layers, unsigned int seed) {
+  MLP *m = (MLP *)calloc(1, sizeof(MLP));
+  if (!m)
+    return NULL;
+
+  unsigned int state = seed ? seed : 2463534242u;
+  int n_params = 0;
+  m->layers = (Layer **)calloc(n_layers, sizeof(Layer *));
+  if (!m->layers)
+    goto fail;
+
+  for (int i = 0; i < n_layers; i++) {
+    int fan_in = i ? sizes[i - 1] : n_in;
+    m->layers[i] = layer_create(fan_in, sizes[i], i < n_layers - 1, &state);
+    if (!m->layers[i])
+      goto fail;
+    m->n_layers = i + 1;
+    n_params += m->layers[i]->n_params;
+    m->width = sizes[i] > m->width ? sizes[i] : m->width;
+  }
+
+  m->params = (Value **)malloc(n_params * sizeof(Value *));
+  m->acts = (Value **)malloc(2 * m->width * sizeof(Value *));
+  if (!m->params || !m->acts)
+    goto fail;
+  for (int i = 0; i < n_layers; i++) {
+    Layer *l = m->layers[i];
+    for (int j = 0; j < l->n_params; j++)
+      m->params[m->n_params++] = l->params[j];
+  }
+  return m;
+
+fail:
+  mlp_free(m);
+  return NULL;
+}
+
+/**
+ * @brief Runs the MLP on one input vector
+ *
+ * Each neuron is a single linear_relu / linear node, so a forward adds one
+ * node per neuron instead of O(fan-in) mul/add nodes.
+ *
+ * @param m Pointer to the MLP
+ * @param x Input Values, one per network input
+ * @param out Receives the outputs, one per neuron of the last layer
+ */
+void mlp_forward(MLP *m, Value **x, Value **out) {
+  Layer **layers = m->layers;
+  int last = m->n_layers - 1;
+
+  Value **in = x;
+  for (int i = 0; i < last; i++) {
+    Value **act = m->acts + (i & 1) * m->width;
+    layer_forward(layers[i], in, act);
+    in = act;
+  }
+  layer_forward(layers[last], in, out);
+}
+
+/** ********** TENSORS ********** **/
+
+/**
+  @struct Tensor
+  @brief  Node in a computational graph w/ a contiguous buffer and its gradient
+  @param (data: [tensor_t]) row-major elements (fp32, bf16 or fp16)
+  @param (grad: [float]) gradient of every element; computed during backward
+  @param (shape: [int]) extent of each dimension
+  @param (ndim: int) number of dimensions
+  @param (size: int) number of elements
+  @param (children: [Tensor]) DAG of children
+  @param (n_children: int) number of children
+  @param (reverse : void) backwards function; accumulates into children grads
+  @param (forward : void) recomputes data from the children
+  @param (visit: unsigned int) epoch of the last topological sort
+  @param (flags: unsigned int) TENSOR_* bits
+  @returns Tensor object with the fields
+ */
+typedef struct Tensor {
+  tensor_t *data;
+  float *grad;
+  int shape[TENSOR_MAX_DIMS];
+  int ndim;
+  int size;
+
+  struct Tensor **children;
+  int n_children;
+  void (*reverse)(struct Tensor *);
+  void (*forward)(struct Tensor *);
+
+  unsigned int visit;
+  unsigned int flags;
+} Tensor;
+
+// tensor lives in an Arena and is released by arena_reset, never by free
+#define TENSOR_ARENA 0x1
+
+// round `n` bytes up to TENSOR_ALIGN
+static size_t tensor_round(size_t n) {
+  return (n + TENSOR_ALIGN - 1) & ~(size_t)(TENSOR_ALIGN - 1);
+}
+
+/**
+ * @brief Allocates a Tensor with its children slots, data and grad buffers
+ *
+ * Everything lives in one block from the active arena (or malloc), with the
+ * buffers aligned to TENSOR_ALIGN so the kernels can use aligned vector
+ * loads. Data and grad are zeroed.
+ *
+ * @param ndim Number of dimensions (at most TENSOR_MAX_DIMS)
+ * @param shape Extent of each dimension
+ * @param n_children Number of children slots
+ * @return Pointer to the new Tensor, or NULL on a bad shape / out of memory
+ */
+static Tensor *make_tensor(int ndim, const int *shape, int n_children) {
+  if (ndim < 1 || ndim > TENSOR_MAX_DIMS)
+    return NULL;
+
+  int size = 1;
+  for (int i = 0; i < ndim; i++)
+    size *= shape[i];
+
+  size_t header = sizeof(Tensor) + n_children * sizeof(Tensor *);
+  size_t buffer = tensor_round((size_t)size * sizeof(tensor_t));
+  size_t grad_buffer = tensor_round((size_t)size * sizeof(float));
+  size_t bytes = tensor_round(header) + buffer + grad_buffer + TENSOR_ALIGN;
+
+  unsigned char *mem = active_arena
+                           ? (unsigned char *)arena_alloc(active_arena, bytes)
+                           : (unsigned char *)malloc(bytes);
+  if (!mem)
+    return NULL;
+
+  Tensor *t = (Tensor *)mem;
+  uintptr_t base = tensor_round((uintptr_t)(mem + header));
+  t->data = (tensor_t *)base;
+  t->grad = (float *)(base + buffer);
+  for (int i = 0; i < size; i++) {
+    t->data[i] = elem_store(0);
+    t->grad[i] = 0;
+  }
+
+  for (int i = 0; i < ndim; i++)
+    t->shape[i] = shape[i];
+  for (int i = ndim; i < TENSOR_MAX_DIMS; i++)
+    t->shape[i] = 1;
+  t->ndim = ndim;
+  t->size = size;
+
+  t->children = n_children ? (Tensor **)(t + 1) : NULL;
+  t->n_children = n_children;
+  t->reverse = NULL;
+  t->forward = NULL;
+  t->visit = 0;
+  t->flags = active_arena ? TENSOR_ARENA : 0;
+
+  return t;
+}
+
+/**
+  @brief free a single Tensor and its buffers; its children are left alone.
+  Tensors drawn from an Arena are left for arena_reset
+  @param (t: Tensor) Tensor object, or NULL
+ */
+void tensor_free(Tensor *t) {
+  if (!t || (t->flags & TENSOR_ARENA))
+    return;
+  free(t);
+}
+
+/**
+  @brief initialize Tensor object from a buffer of floats
+  @param (data: [float]) `size` row-major elements to copy, or NULL for zeros;
+  narrowed to tensor_t on the way in
+  @param (ndim: int) number of dimensions
+  @param (shape: [int]) extent of each dimension
+  @returns Tensor object, or NULL on a bad shape / out of memory
+ */
+Tensor *defaultTensor(const float *data, int ndim, const int *shape) {
+  Tensor *t = make_tensor(ndim, shape, 0);
+  if (t && data) {
+    for (int i = 0; i < t->size; i++)
+      t->data[i] = elem_store(data[i]);
+  }
+  return t;
+}
+
+/**
+  @brief reset every element of the gradient to 0
+  @param (t: Tensor) Tensor object
+ */
+void tensor_zero_grad(Tensor *t) {
+  for (int i = 0; i < t->size; i++)
+    t->grad[i] = 0;
+}
+
+// 1 if a and b have the same shape
+static int same_shape(const Tensor *a, const Tensor *b) {
+  if (a->ndim != b->ndim)
+    return 0;
+  for (int i = 0; i < a->ndim; i++)
+    if (a->shape[i] != b->shape[i])
+      return 0;
+  return 1;
+}
+
+/**
+   Elementwise kernels. Each loop is a single pass over `restrict` buffers
+   with no calls or branches (pwr aside), so the compiler vectorizes them.
+   Reverse kernels accumulate into one child at a time, which keeps the
+   `restrict` promise even when both children are the same Tensor.
+   Data goes through elem_load / elem_store, which are plain copies for fp32
+   storage and inline widen / narrow steps for 16-bit storage.
+*/
+
+static void kernel_add(tensor_t *restrict c, const tensor_t *restrict a,
+                       const tensor_t *restrict b, int n) {
+  for (int i = 0; i < n; i++)
+    c[i] = elem_store(elem_load(a[i]) + elem_load(b[i]));
+}
+
+static void kernel_mul(tensor_t *restrict c, const tensor_t *restrict a,
+                       const tensor_t *restrict b, int n) {
+  for (int i = 0; i < n; i++)
+    c[i] = elem_store(elem_load(a[i]) * elem_load(b[i]));
+}
+
+static void kernel_relu(tensor_t *restrict c, const tensor_t *restrict a,
+                        int n) {
+  for (int i = 0; i < n; i++) {
+    float x = elem_load(a[i]);
+    c[i] = elem_store(x > 0 ? x : 0);
+  }
+}
+
+static void kernel_pwr(tensor_t *restrict c, const tensor_t *restrict a,
+                       const tensor_t *restrict b, int n) {
+  for (int i = 0; i < n; i++)
+    c[i] = elem_store(powf(elem_load(a[i]), elem_load(b[i])));
+}
+
+// g += gc
+static void kernel_acc(float *restrict g, const float *restrict gc, int n) {
+  for (int i = 0; i < n; i++)
+    g[i] += gc[i];
+}
+
+// g += gc * x
+static void kernel_acc_mul(float *restrict g, const float *restrict gc,
+                           const tensor_t *restrict x, int n) {
+  for (int i = 0; i < n; i++)
+    g[i] += gc[i] * elem_load(x[i]);
+}
+
+// g += gc where a > 0
+static void kernel_acc_relu(float *restrict g, const float *restrict gc,
+                            const tensor_t *restrict a, int n) {
+  for (int i = 0; i < n; i++)
+    g[i] += elem_load(a[i]) > 0 ? gc[i] : 0;
+}
+
+void tensor_add_forward(Tensor *c) {
+  kernel_add(c->data, c->children[0]->data, c->children[1]->data, c->size);
+}
+
+void tensor_mul_forward(Tensor *c) {
+  kernel_mul(c->data, c->children[0]->data, c->children[1]->data, c->size);
+}
+
+void tensor_pwr_forward(Tensor *c) {
+  kernel_pwr(c->data, c->children[0]->data, c->children[1]->data, c->size);
+}
+
+void tensor_relu_forward(Tensor *c) {
+  kernel_relu(c->data, c->children[0]->data, c->size);
+}
+
+void tensor_add_reverse(Tensor *c) {
+  kernel_acc(c->children[0]->grad, c->grad, c->size);
+  kernel_acc(c->children[1]->grad, c->grad, c->size);
+}
+
+void tensor_mul_reverse(Tensor *c) {
+  Tensor *a = c->children[0];
+  Tensor *b = c->children[1];
+  kernel_acc_mul(a->grad, c->grad, b->data, c->size);
+  kernel_acc_mul(b->grad, c->grad, a->data, c->size);
+}
+
+/**
+ @brief computes gradient of the elementwise power a ^ b (backprop)
+ @param (c : Tensor) Tensor object
+
+ - dc/da = b * a^(b-1) * grad of c
+ - dc/db = log(a) * c * grad of c, only where a > 0
+ */
+void tensor_pwr_reverse(Tensor *c) {
+  Tensor *a = c->children[0];
+  Tensor *b = c->children[1];
+  for (int i = 0; i < c->size; i++) {
+    float x = elem_load(a->data[i]), y = elem_load(b->data[i]);
+    a->grad[i] += y * powf(x, y - 1) * c->grad[i];
+  }
+  for (int i = 0; i < c->size; i++) {
+    float x = elem_load(a->data[i]);
+    if (x > 0)
+      b->grad[i] += logf(x) * elem_load(c->data[i]) * c->grad[i];
+  }
+}
+
+void tensor_relu_reverse(Tensor *c) {
+  Tensor *a = c->children[0];
+  kernel_acc_relu(a->grad, c->grad, a->data, c->size);
+}
+
+// node with children a (and b) computed by forward, or NULL on shape mismatch
+static Tensor *tensor_binary(Tensor *a, Tensor *b,
+                             void (*forward)(Tensor *),
+                             void (*reverse)(Tensor *)) {
+  if (!same_shape(a, b))
+    return NULL;
+
+  Tensor *res = make_tensor(a->ndim, a->shape, 2);
+  if (!res)
+    return NULL;
+
+  res->children[0] = a;
+  res->children[1] = b;
+  res->forward = forward;
+  res->reverse = reverse;
+  res->forward(res);
+
+  return res;
+}
+
+/**
+ @brief elementwise a + b of two tensors with the same shape
+ @returns new Tensor, or NULL if the shapes differ
+ */
+Tensor *tensor_add(Tensor *a, Tensor *b) {
+  return tensor_binary(a, b, tensor_add_forward, tensor_add_reverse);
+}
+
+/**
+ @brief elementwise a * b of two tensors with the same shape
+ @returns new Tensor, or NULL if the shapes differ
+ */
+Tensor *tensor_mul(Tensor *a, Tensor *b) {
+  return tensor_binary(a, b, tensor_mul_forward, tensor_mul_reverse);
+}
+
+/**
+ @brief elementwise a ^ b of two tensors with the same shape
+ @returns new Tensor, or NULL if the shapes differ
+ */
+Tensor *tensor_pwr(Tensor *a, Tensor *b) {
+  return tensor_binary(a, b, tensor_pwr_forward, tensor_pwr_reverse);
+}
+
+/**
+ @brief elementwise max(0, a)
+ @returns new Tensor, or NULL if out of memory
+ */
+Tensor *tensor_relu(Tensor *a) {
+  Tensor *res = make_tensor(a->ndim, a->shape, 1);
+  if (!res)
+    return NULL;
+
+  res->children[0] = a;
+  res->forward = tensor_relu_forward;
+  res->reverse = tensor_relu_reverse;
+  res->forward(res);
+
+  return res;
+}
+
+/**
+   Matrix multiply. gemm computes C += op(A) * B for row-major B and C, where
+   A is addressed through row/column strides so the same kernel serves both
+   A and its transpose. Loops are blocked so a GEMM_KC x GEMM_NC panel of B
+   stays in cache, and the micro-kernel updates four rows of C per pass over
+   a row of B so each loaded B element feeds four multiply-adds.
+*/
+
+#ifndef MICROGRAD_BLAS
+// c_r[j] += a_r * b[j] for four rows r of C
+static void gemm_micro4(float *restrict c0, float *restrict c1,
+                        float *restrict c2, float *restrict c3, float a0,
+                        float a1, float a2, float a3, const float *restrict b,
+                        int n) {
+  for (int j = 0; j < n; j++) {
+    float bj = b[j];
+    c0[j] += a0 * bj;
+    c1[j] += a1 * bj;
+    c2[j] += a2 * bj;
+    c3[j] += a3 * bj;
+  }
+}
+
+// c[j] += a * b[j]
+static void gemm_micro1(float *restrict c, float a, const float *restrict b,
+                        int n) {
+  for (int j = 0; j < n; j++)
+    c[j] += a * b[j];
+}
+
+/**
+ * @brief Blocked C[m,n] += A[m,k] * B[k,n]
+ *
+ * @param m,n,k Matrix extents
+ * @param A Left operand; element (i, p) is A[i * rs_a + p * cs_a]
+ * @param rs_a,cs_a Row and column strides of A
+ * @param B Right operand, row-major with leading dimension ldb
+ * @param C Output, row-major with leading dimension ldc
+ */
+static void gemm(int m, int n, int k, const float *A, int rs_a, int cs_a,
+                 const float *B, int ldb, float *C, int ldc) {
+  for (int jj = 0; jj < n; jj += GEMM_NC) {
+    int nb = n - jj < GEMM_NC ? n - jj : GEMM_NC;
+
+    for (int pp = 0; pp < k; pp += GEMM_KC) {
+      int kb = k - pp < GEMM_KC ? k - pp : GEMM_KC;
+
+      for (int ii = 0; ii < m; ii += GEMM_MC) {
+        int mb = m - ii < GEMM_MC ? m - ii : GEMM_MC;
+
+        int i = ii;
+        for (; i + 4 <= ii + mb; i += 4) {
+          float *c = C + (size_t)i * ldc + jj;
+          for (int p = pp; p < pp + kb; p++) {
+            const float *a = A + (size_t)i * rs_a + (size_t)p * cs_a;
+            gemm_micro4(c, c + ldc, c + 2 * ldc, c + 3 * ldc, a[0],
+                        a[rs_a], a[2 * rs_a], a[3 * rs_a],
+                        B + (size_t)p * ldb + jj, nb);
+          }
+        }
+        for (; i < ii + mb; i++) {
+          float *c = C + (size_t)i * ldc + jj;
+          for (int p = pp; p < pp + kb; p++)
+            gemm_micro1(c, A[(size_t)i * rs_a + (size_t)p * cs_a],
+                        B + (size_t)p * ldb + jj, nb);
+        }
+      }
+    }
+  }
+}
+
+// scratch for transposed operands, grown as needed and kept between calls on
+// this thread
+static _Thread_local float *gemm_scratch = NULL;
+static _Thread_local int gemm_scratch_cap = 0;
+
+#ifndef MICROGRAD_TENSOR_FP32
+// 16-bit storage: operands widened to fp32 before they reach the kernel
+static _Thread_local float *gemm_wide = NULL;
+static _Thread_local int gemm_wide_cap = 0;
+
+// widen n stored elements into slot `at` of gemm_wide
+static float *gemm_widen(const tensor_t *x, int n, int at) {
+  float *dst = gemm_wide + at;
+  for (int i = 0; i < n; i++)
+    dst[i] = elem_load(x[i]);
+  return dst;
+}
+#endif
+#endif
+
+void tensor_matmul_forward(Tensor *c) {
+  Tensor *a = c->children[0];
+  Tensor *b = c->children[1];
+  int m = a->shape[0], k = a->shape[1], n = b->shape[1];
+
+#ifdef MICROGRAD_BLAS
+  for (int i = 0; i < c->size; i++)
+    c->data[i] = 0;
+  cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1.0f,
+              a->data, k, b->data, n, 0.0f, c->data, n);
+#elif defined(MICROGRAD_TENSOR_FP32)
+  for (int i = 0; i < c->size; i++)
+    c->data[i] = 0;
+  gemm(m, n, k, a->data, k, 1, b->data, n, c->data, n);
+#else
+  if (grow_buffer((void **)&gemm_wide, &gemm_wide_cap,
+                  a->size + b->size + c->size, sizeof(float)) != 0)
+    return;
+  float *wa = gemm_widen(a->data, a->size, 0);
+  float *wb = gemm_widen(b->data, b->size, a->size);
+  float *wc = gemm_wide + a->size + b->size;
+  for (int i = 0; i < c->size; i++)
+    wc[i] = 0;
+  gemm(m, n, k, wa, k, 1, wb, n, wc, n);
+  for (int i = 0; i < c->size; i++)
+    c->data[i] = elem_store(wc[i]);
+#endif
+}
+
+/**
+ * @brief Computes gradients of C = A * B (backprop)
+ *
+ * - dA += dC * B^T
+ * - dB += A^T * dC
+ *
+ * A^T only needs strided reads of A, but B^T is packed into a scratch buffer
+ * so the kernel can stream its rows. With 16-bit storage the packing also
+ * widens B, and A is widened into its own scratch.
+ *
+ * @param c Pointer to the Tensor representing the matmul
+ */
+void tensor_matmul_reverse(Tensor *c) {
+  Tensor *a = c->children[0];
+  Tensor *b = c->children[1];
+  int m = a->shape[0], k = a->shape[1], n = b->shape[1];
+
+#ifdef MICROGRAD_BLAS
+  cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, m, k, n, 1.0f, c->grad,
+              n, b->data, n, 1.0f, a->grad, k);
+  cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans, k, n, m, 1.0f, a->data,
+              k, c->grad, n, 1.0f, b->grad, n);
+#else
+  if (grow_buffer((void **)&gemm_scratch, &gemm_scratch_cap, k * n,
+                  sizeof(float)) == 0) {
+    for (int p = 0; p < k; p++)
+      for (int j = 0; j < n; j++)
+        gemm_scratch[(size_t)j * k + p] = elem_load(b->data[(size_t)p * n + j]);
+    gemm(m, k, n, c->grad, n, 1, gemm_scratch, k, a->grad, k);
+  }
+#ifdef MICROGRAD_TENSOR_FP32
+  gemm(k, n, m, a->data, 1, k, c->grad, n, b->grad, n);
+#else
+  if (grow_buffer((void **)&gemm_wide, &gemm_wide_cap, a->size,
+                  sizeof(float)) == 0)
+    gemm(k, n, m, gemm_widen(a->data, a->size, 0), 1, k, c->grad, n, b->grad,
+         n);
+#endif
+#endif
+}
+
+/**
+ @brief matrix product of A [m, k] and B [k, n]
+ @param (a: Tensor) 2-d Tensor object
+ @param (b: Tensor) 2-d Tensor object
+ @returns new [m, n] Tensor, or NULL if the shapes don't line up
+ */
+Tensor *tensor_matmul(Tensor *a, Tensor *b) {
+  if (a->ndim != 2 || b->ndim != 2 || a->shape[1] != b->shape[0])
+    return NULL;
+
+  int shape[2] = {a->shape[0], b->shape[1]};
+  Tensor *res = make_tensor(2, shape, 2);
+  if (!res)
+    return NULL;
+
+  res->children[0] = a;
+  res->children[1] = b;
+  res->forward = tensor_matmul_forward;
+  res->reverse = tensor_matmul_reverse;
+  res->forward(res);
+
+  return res;
+}
+
+/**
+  @struct TensorTopo
+  @brief  Reusable topological order of a Tensor graph (see Topo)
+ */
+typedef struct TensorTopo {
+  Tensor **order;
+  int size;
+  int cap;
+
+  struct TensorFrame {
+    Tensor *node;
+    int next;
+  } *stack;
+  int stack_cap;
+} TensorTopo;
+
+/**
+  @brief initialize an empty TensorTopo
+  @param (topo: TensorTopo) TensorTopo object
+ */
+void tensor_topo_init(TensorTopo *topo) {
+  topo->order = NULL;
+  topo->size = 0;
+  topo->cap = 0;
+  topo->stack = NULL;
+  topo->stack_cap = 0;
+}
+
+/**
+  @brief free the buffers held by a TensorTopo
+  @param (topo: TensorTopo) TensorTopo object
+ */
+void tensor_topo_free(TensorTopo *topo) {
+  free(topo->order);
+  free(topo->stack);
+  tensor_topo_init(topo);
+}
+
+/**
+ * @brief Topologically sorts a Tensor graph; same algorithm as build_dag
+ *
+ * @param root Pointer to the root Tensor object
+ * @param topo TensorTopo receiving the sorted nodes
+ * @return Number of nodes in the DAG, or -1 if out of memory
+ */
+int tensor_build_dag(Tensor *root, TensorTopo *topo) {
+  unsigned int epoch = next_epoch();
+  int sp = 0;
+
+  topo->size = 0;
+  if (grow_buffer((void **)&topo->stack, &topo->stack_cap, 1,
+                  sizeof(*topo->stack)))
+    return -1;
+
+  root->visit = epoch;
+  topo->stack[sp].node = root;
+  topo->stack[sp].next = 0;
+  sp++;
+
+  while (sp > 0) {
+    struct TensorFrame *frame = &topo->stack[sp - 1];
+    Tensor *node = frame->node;
+
+    if (frame->next < node->n_children) {
+      Tensor *child = node->children[frame->next++];
+      if (child->visit == epoch)
+        continue;
+      child->visit = epoch;
+
+      if (grow_buffer((void **)&topo->stack, &topo->stack_cap, sp + 1,
+                      sizeof(*topo->stack)))
+        return -1;
+      topo->stack[sp].node = child;
+      topo->stack[sp].next = 0;
+      sp++;
+    } else {
+      if (grow_buffer((void **)&topo->order, &topo->cap, topo->size + 1,
+                      sizeof(Tensor *)))
+        return -1;
+      topo->order[topo->size++] = node;
+      sp--;
+    }
+  }
+
+  return topo->size;
+}
+
+/**
+  @brief applies the clipping configuration to the leaf tensors' gradients
+  @param (order: [Tensor]) sorted nodes
+  @param (n: int) number of nodes
+ */
+static void tensor_clip(Tensor **order, int n) {
+  GradClip clip = grad_clip_config;
+
+  // Tensor grads are always fp32, so this can't share the grad_t helpers
+  if (clip.mode == CLIP_RANGE) {
+    for (int i = 0; i < n; i++) {
+      if (order[i]->n_children)
+        continue;
+      float *g = order[i]->grad;
+      for (int j = 0; j < order[i]->size; j++) {
+        float x = g[j] < clip.min ? clip.min : g[j];
+        g[j] = x > clip.max ? clip.max : x;
+      }
+    }
+  } else if (clip.mode == CLIP_NORM) {
+    float sum = 0;
+    for (int i = 0; i < n; i++)
+      if (!order[i]->n_children)
+        for (int j = 0; j < order[i]->size; j++)
+          sum += order[i]->grad[j] * order[i]->grad[j];
+
+    float norm = sqrtf(sum);
+    if (norm > clip.max_norm) {
+      float s = clip.max_norm / norm;
+      for (int i = 0; i < n; i++)
+        if (!order[i]->n_children)
+          for (int j = 0; j < order[i]->size; j++)
+            order[i]->grad[j] *= s;
+    }
+  }
+}
+
+/**
+ * @brief Performs the reverse pass on a Tensor graph
+ *
+ * Seeds every element of the root's gradient with 1.0 (the gradient of the
+ * sum of its elements) and runs each node's reverse kernel, parents first.
+ *
+ * @param root Pointer to the root Tensor object of the computational graph
+ */
+void tensor_reverse(Tensor *root) {
+  static _Thread_local TensorTopo topo = {NULL, 0, 0, NULL, 0};
+  if (tensor_build_dag(root, &topo) < 0)
+    return;
+
+  for (int i = 0; i < root->size; i++)
+    root->grad[i] = 1.0;
+
+  for (int i = topo.size - 1; i >= 0; i--) {
+    if (topo.order[i]->reverse)
+      topo.order[i]->reverse(topo.order[i]);
+  }
+  tensor_clip(topo.order, topo.size);
 }
 
 // /** ********** MAIN ********** **/